@@ -0,0 +1,107 @@
+#pragma once
+#include <chrono>
+#include "../src/shared.hpp"
+
+/// Keep the compiler from optimizing away a value computed by a benchmark
+template <typename T>
+inline void do_not_optimize (const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+/// The state of one benchmark run, in the style of Google Benchmark:
+/// the benchmark loops with `for (auto _ : state)` and may report the bytes and items it processed.
+class benchmark_state {
+    protected:
+        size_t iterations;
+        double bytes = 0;
+        double items = 0;
+
+    public:
+        /// What the loop variable holds: nothing, marked unused so `_` doesn't warn under -Wall
+        struct [[maybe_unused]] value {};
+
+        struct iterator {
+            size_t remaining;
+
+            bool operator!= (const iterator& other) const { return remaining != other.remaining; }
+            void operator++ () { remaining--; }
+            value operator* () const { return value(); }
+        };
+
+        explicit benchmark_state (size_t iterations) {
+            this->iterations = iterations;
+        }
+
+        iterator begin () const { return iterator { iterations }; }
+        iterator end () const { return iterator { 0 }; }
+
+        size_t max_iterations () const { return iterations; }
+
+        /// Report the bytes processed over all iterations
+        void set_bytes_processed (double value) { bytes = value; }
+        /// Report the items processed over all iterations
+        void set_items_processed (double value) { items = value; }
+
+        double bytes_processed () const { return bytes; }
+        double items_processed () const { return items; }
+};
+
+typedef void (*benchmark_function) (benchmark_state& state);
+
+struct benchmark_entry {
+    const char* name;
+    benchmark_function function;
+};
+
+/// Every benchmark registered with BENCHMARK()
+inline vector<benchmark_entry>& benchmark_registry () {
+    static vector<benchmark_entry> entries;
+    return entries;
+}
+
+struct benchmark_registration {
+    benchmark_registration (const char* name, benchmark_function function) {
+        benchmark_registry().push_back(benchmark_entry { name, function });
+    }
+};
+
+#define BENCHMARK(__function) static benchmark_registration __function##_registration (#__function, __function);
+
+/// Run every registered benchmark whose name contains the filter.
+/// Iterations are doubled until a run takes at least min_seconds, then the averages are printed.
+inline void run_benchmarks (const string& filter, double min_seconds) {
+    cout << std::left << std::setw(36) << "Benchmark" << std::right << std::setw(14) << "Time" << std::setw(14) << "Iterations"
+         << std::setw(14) << "Throughput" << std::setw(18) << "Items" << "\n";
+    cout << string(96, '-') << endl;
+
+    for (const benchmark_entry& entry : benchmark_registry()) {
+        if (string(entry.name).find(filter) == string::npos) continue;
+
+        // Warm up caches and branch predictors first
+        benchmark_state warmup = benchmark_state(1);
+        entry.function(warmup);
+
+        size_t iterations = 1; double seconds = 0;
+        benchmark_state state = benchmark_state(iterations);
+        while (true) {
+            state = benchmark_state(iterations);
+            auto start = std::chrono::steady_clock::now();
+            entry.function(state);
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            if (seconds >= min_seconds || iterations >= ((size_t)1 << 40)) break;
+            iterations *= 2;
+        }
+
+        double ns = seconds * 1e9 / (double)iterations;
+        cout << std::left << std::setw(36) << entry.name << std::right << std::fixed << std::setprecision(2)
+             << std::setw(11) << (ns >= 1e6 ? ns / 1e6 : ns) << (ns >= 1e6 ? " ms" : " ns")
+             << std::setw(14) << iterations;
+
+        if (state.bytes_processed() > 0) cout << std::setw(9) << (state.bytes_processed() / seconds / 1e6) << " MB/s";
+        else cout << std::setw(14) << "";
+
+        if (state.items_processed() > 0) cout << std::setw(12) << (state.items_processed() / seconds / 1e6) << " M/s";
+        cout << endl;
+    }
+}
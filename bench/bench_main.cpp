@@ -0,0 +1,198 @@
+#include <map>
+#include "bench.hpp"
+#include "corpus_generator.hpp"
+#include "../src/assembler/tokenizer.hpp"
+#include "../src/assembler/emitter.hpp"
+
+/// The size of the generated source used by the end-to-end benchmarks
+size_t corpus_size = 16 << 20;
+
+const string& corpus () {
+    static string text = corpus_generator(corpus_options()).generate(corpus_size);
+    return text;
+}
+
+vector<string> mnemonic_names () {
+    vector<string> names;
+    for (const instructions::opcode_spec& spec : instructions::opcode_table) names.emplace_back(spec.mnemonic);
+    names.emplace_back("lod");
+    names.emplace_back("jumpp");
+    names.emplace_back("unknown_instruction");
+    return names;
+}
+
+// #################################################
+// Mnemonic lookup: the compile-time perfect hash against the std::map registry it replaced
+
+void lookup_map_subscript (benchmark_state& state) {
+    vector<string> names = mnemonic_names();
+    map<string, const instructions::opcode_spec*> registry;
+    for (const instructions::opcode_spec& spec : instructions::opcode_table) registry[string(spec.mnemonic)] = &spec;
+
+    size_t index = 0;
+    for (auto _ : state) {
+        string_view name = names[index++ % names.size()];
+        do_not_optimize(registry[string(name)]);
+    }
+    state.set_items_processed((double)state.max_iterations());
+}
+BENCHMARK(lookup_map_subscript)
+
+void lookup_map_find (benchmark_state& state) {
+    vector<string> names = mnemonic_names();
+    map<string, const instructions::opcode_spec*, less<>> registry;
+    for (const instructions::opcode_spec& spec : instructions::opcode_table) registry[string(spec.mnemonic)] = &spec;
+
+    size_t index = 0;
+    for (auto _ : state) {
+        auto found = registry.find(string_view(names[index++ % names.size()]));
+        do_not_optimize(found == registry.end() ? nullptr : found->second);
+    }
+    state.set_items_processed((double)state.max_iterations());
+}
+BENCHMARK(lookup_map_find)
+
+void lookup_perfect_hash (benchmark_state& state) {
+    vector<string> names = mnemonic_names();
+    size_t index = 0;
+    for (auto _ : state) {
+        do_not_optimize(instructions::instruction_table.find(names[index++ % names.size()]));
+    }
+    state.set_items_processed((double)state.max_iterations());
+}
+BENCHMARK(lookup_perfect_hash)
+
+// #################################################
+// Single operations
+
+void parse_number_mixed (benchmark_state& state) {
+    const string_view literals[] = { "0", "255", "0xFF", "0b10101010", "0x1234", "65535", "42", "0b1" };
+    tokenizer_result result = tokenizer_result();
+
+    size_t index = 0;
+    for (auto _ : state) {
+        uint value;
+        instructions::parse_number(literals[index++ % 8], &value, 2, 1, &result);
+        do_not_optimize(value);
+    }
+    state.set_items_processed((double)state.max_iterations());
+}
+BENCHMARK(parse_number_mixed)
+
+void tokenize_line_instruction (benchmark_state& state) {
+    const string_view line = "memw    1 0x0200       ; Store the first register into memory";
+    assembly_tokenizer tokenizer = assembly_tokenizer();
+    tokenizer_result result = tokenizer_result();
+
+    // Each line is encoded into an empty result, so the image stays one record and only the line is measured
+    for (auto _ : state) {
+        result.clear();
+        tokenizer.tokenize_line(line, 1, &result);
+    }
+    do_not_optimize(result.image.data());
+    state.set_bytes_processed((double)(line.size() * state.max_iterations()));
+    state.set_items_processed((double)state.max_iterations());
+}
+BENCHMARK(tokenize_line_instruction)
+
+void tokenize_line_comment (benchmark_state& state) {
+    const string_view line = "    ; TODO: Remove memory exchange -- seems unnecessary";
+    assembly_tokenizer tokenizer = assembly_tokenizer();
+    tokenizer_result result = tokenizer_result();
+
+    for (auto _ : state) {
+        tokenizer.tokenize_line(line, 1, &result);
+    }
+    do_not_optimize(result.todos);
+    state.set_bytes_processed((double)(line.size() * state.max_iterations()));
+    state.set_items_processed((double)state.max_iterations());
+}
+BENCHMARK(tokenize_line_comment)
+
+// Splitting a whole corpus into tokens, without encoding
+void scan_corpus (benchmark_state& state, scanner::mask_function masks) {
+    const string& text = corpus();
+    scanner::mask_function selected = scanner::compute_masks;
+    scanner::compute_masks = masks;
+
+    size_t tokens = 0;
+    for (auto _ : state) {
+        scanner::scan_lines(text, [&](const line_tokens& parts, string_view, bool has_comment) {
+            tokens += parts.size() + has_comment;
+        });
+    }
+    scanner::compute_masks = selected;
+
+    do_not_optimize(tokens);
+    state.set_bytes_processed((double)(text.size() * state.max_iterations()));
+}
+
+void scan_corpus_scalar (benchmark_state& state) {
+    scan_corpus(state, scanner::masks_scalar);
+}
+BENCHMARK(scan_corpus_scalar)
+
+void scan_corpus_selected (benchmark_state& state) {
+    scan_corpus(state, scanner::compute_masks);
+}
+BENCHMARK(scan_corpus_selected)
+
+void emit_image (benchmark_state& state) {
+    vector<byte> image = vector<byte>(8 << 20, 0x5A);
+    string target = "koda_asm_bench_emit.bin";
+
+    for (auto _ : state) {
+        emitter::write_image(target, image.data(), image.size());
+    }
+    remove(target.c_str());
+    state.set_bytes_processed((double)(image.size() * state.max_iterations()));
+}
+BENCHMARK(emit_image)
+
+// #################################################
+// End to end, on a generated corpus
+
+void assemble_corpus (benchmark_state& state, unsigned int threads) {
+    const string& text = corpus();
+    assembly_tokenizer tokenizer = assembly_tokenizer();
+    size_t instructions = 0;
+
+    for (auto _ : state) {
+        tokenizer_result result = tokenizer_result();
+        if (threads > 1) tokenizer.tokenize_parallel(text, &result, threads);
+        else tokenizer.tokenize_text(text, 1, &result);
+        result.resolve_symbols();
+
+        instructions = result.instruction_count();
+        do_not_optimize(result.image.data());
+    }
+    state.set_bytes_processed((double)(text.size() * state.max_iterations()));
+    state.set_items_processed((double)(instructions * state.max_iterations()));
+}
+
+void assemble_corpus_serial (benchmark_state& state) {
+    assemble_corpus(state, 1);
+}
+BENCHMARK(assemble_corpus_serial)
+
+void assemble_corpus_parallel (benchmark_state& state) {
+    assemble_corpus(state, std::max(2u, std::thread::hardware_concurrency()));
+}
+BENCHMARK(assemble_corpus_parallel)
+
+int main (int argc, char* argv[]) {
+    string filter; double min_seconds = 0.5;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.rfind("--filter=", 0) == 0) filter = arg.substr(9);
+        else if (arg.rfind("--min-time=", 0) == 0) min_seconds = atof(arg.substr(11).c_str());
+        else if (arg.rfind("--corpus-size=", 0) == 0) corpus_size = (size_t)strtoull(arg.substr(14).c_str(), nullptr, 10) << 20;
+        else {
+            cout << "Usage: koda_asm_bench [--filter=<name>] [--min-time=<seconds>] [--corpus-size=<MiB>]" << endl;
+            return 1;
+        }
+    }
+
+    run_benchmarks(filter, min_seconds);
+    return 0;
+}
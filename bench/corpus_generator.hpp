@@ -0,0 +1,106 @@
+#pragma once
+#include <cstdio>
+#include "../src/shared.hpp"
+#include "../src/assembler/opcodes.hpp"
+
+/// Settings for a generated Koda source
+struct corpus_options {
+    uint64_t seed = 1;
+
+    /// The share of lines that carry a comment
+    double comment_density = 0.2;
+
+    /// The share of comments that are to-do comments
+    double todo_density = 0.05;
+};
+
+/// Generates deterministic Koda sources that use every instruction of the opcode table.
+/// The same options always produce the same text.
+class corpus_generator {
+    protected:
+        corpus_options options;
+        uint64_t state;
+        size_t lines = 0;
+
+        /// xorshift64*
+        uint64_t next () {
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            return state * 0x2545F4914F6CDD1Dull;
+        }
+
+        double next_unit () {
+            return (double)(next() >> 11) / (double)(1ull << 53);
+        }
+
+        void append_number (string& out, uint value, int size) {
+            char buffer[32];
+            switch (next() % 3) {
+                case 0: snprintf(buffer, sizeof(buffer), "%u", value); break;
+                case 1: snprintf(buffer, sizeof(buffer), "0x%0*X", size * 2, value); break;
+                default: {
+                    int bits = size * 8, length = 2;
+                    buffer[0] = '0'; buffer[1] = 'b';
+                    for (int i = bits - 1; i >= 0; i--) buffer[length++] = (char)('0' + ((value >> i) & 1));
+                    buffer[length] = 0;
+                }
+            }
+            out += buffer;
+        }
+
+    public:
+        explicit corpus_generator (const corpus_options& options) {
+            this->options = options;
+            this->state = options.seed * 0x9E3779B97F4A7C15ull + 1;
+        }
+
+        /// Append one line (including the newline) to the output.
+        /// The first lines cycle through the whole opcode table, so even small corpora cover every instruction.
+        void generate_line (string& out) {
+            const instructions::opcode_spec& spec = (lines < instructions::opcode_table.size())
+                ? instructions::opcode_table[lines]
+                : instructions::opcode_table[next() % instructions::opcode_table.size()];
+            lines++;
+
+            size_t start = out.size();
+            out += spec.mnemonic;
+            for (int i = 0; i < spec.operand_count; i++) {
+                out += ' ';
+                switch (spec.operands[i]) {
+                    case instructions::reg8: out += to_string(next() % 16); break;
+                    case instructions::addr16: append_number(out, (uint)(next() & 0xFFFF), 2); break;
+                    default: append_number(out, (uint)(next() & 0xFF), 1); break;
+                }
+            }
+
+            if (next_unit() < options.comment_density) {
+                out.append(std::max<size_t>(1, 24 - std::min<size_t>(24, out.size() - start)), ' ');
+                if (next_unit() < options.todo_density) out += "; TODO: Check this generated instruction";
+                else out += "; Generated instruction";
+            }
+
+            out += '\n';
+        }
+
+        /// Generate a source of at least the given size in memory
+        string generate (size_t size) {
+            string out;
+            out.reserve(size + 128);
+            while (out.size() < size) generate_line(out);
+            return out;
+        }
+
+        /// Write a source of at least the given size to a file, a few megabytes at a time
+        bool write (FILE* file, size_t size) {
+            string buffer; size_t written = 0;
+            while (written < size) {
+                buffer.clear();
+                while (buffer.size() < (4 << 20) && written + buffer.size() < size) generate_line(buffer);
+
+                if (fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size()) return false;
+                written += buffer.size();
+            }
+            return true;
+        }
+};
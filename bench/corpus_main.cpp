@@ -0,0 +1,50 @@
+#include "corpus_generator.hpp"
+
+/// Parse a size like 512K, 16M or 1G
+size_t parse_size (const string& text) {
+    size_t value = (size_t)strtoull(text.c_str(), nullptr, 10);
+    switch (text.empty() ? 0 : toupper(text.back())) {
+        case 'K': return value << 10;
+        case 'M': return value << 20;
+        case 'G': return value << 30;
+        default: return value;
+    }
+}
+
+int main (int argc, char* argv[]) {
+    if (argc < 3) {
+        cout << "Usage: koda_asm_corpus <output file> <size> [--seed N] [--comments 0..1] [--todos 0..1]" << endl;
+        return 1;
+    }
+
+    string target = argv[1];
+    size_t size = parse_size(argv[2]);
+
+    corpus_options options = corpus_options();
+    for (int i = 3; i + 1 < argc; i += 2) {
+        string arg = argv[i];
+        if (arg == "--seed") options.seed = strtoull(argv[i + 1], nullptr, 10);
+        else if (arg == "--comments") options.comment_density = atof(argv[i + 1]);
+        else if (arg == "--todos") options.todo_density = atof(argv[i + 1]);
+        else {
+            cout << "Unknown option " << arg << endl;
+            return 1;
+        }
+    }
+
+    FILE* file = fopen(target.c_str(), "wb");
+    if (file == nullptr) {
+        cout << "Unable to open output file." << endl;
+        return 2;
+    }
+
+    corpus_generator generator = corpus_generator(options);
+    bool ok = generator.write(file, size);
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok) {
+        cout << "Unable to write output file." << endl;
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,243 @@
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include "../src/shared.hpp"
+#include "../src/assembler/tokenizer.hpp"
+#include "../src/assembler/optimizer.hpp"
+#include "../src/assembler/disassembler.hpp"
+
+/// Built with -DKODA_ASM_LIBFUZZER=ON, this file is a libFuzzer target.
+/// Otherwise it is a replay tool that runs a corpus through the same checks, timing each input and counting its heap allocations.
+
+/// Abort with a message if a check fails, so fuzzers and sanitizers report the input
+void expect (bool condition, const char* message) {
+    if (condition) return;
+    cerr << "koda_asm_fuzz: " << message << endl;
+    abort();
+}
+
+tokenizer_result new_result () {
+    tokenizer_result result = tokenizer_result();
+    result.diagnostic_limit = 16;
+    return result;
+}
+
+assembly_tokenizer new_tokenizer () {
+    assembly_tokenizer tokenizer = assembly_tokenizer();
+    tokenizer.file_access = false;
+    tokenizer.includes = nullptr;
+    return tokenizer;
+}
+
+/// Assemble one input in memory and check that the different ways of reading it agree.
+/// Returns the size of the image.
+size_t assemble_input (string_view text) {
+    tokenizer_result result = new_result();
+    result.keep_relocations = true;
+    assembly_tokenizer tokenizer = new_tokenizer();
+    tokenizer.tokenize_source(text, &result);
+
+    // Without macros and includes, every line can also be tokenized on its own, as the cache does for its blocks
+    if (!assembly_tokenizer::has_directives(text)) {
+        tokenizer_result lines = new_result();
+        assembly_tokenizer line_tokenizer = new_tokenizer();
+        int line_num = 1;
+        for (size_t start = 0; start < text.size(); line_num++) {
+            size_t end = text.find('\n', start);
+            if (end == string_view::npos) end = text.size();
+            line_tokenizer.tokenize_line(text.substr(start, end - start), line_num, &lines);
+            start = end + 1;
+        }
+        lines.resolve_symbols();
+
+        expect(lines.errors == result.errors, "tokenize_line and tokenize_text report a different number of errors");
+        expect(lines.image == result.image, "tokenize_line and tokenize_text produce different images");
+    }
+
+    if (result.errors > 0) return result.image.size();
+
+    // Every image must disassemble to text that assembles to the same image, before and after optimizing
+    assembly_tokenizer verifier = new_tokenizer();
+    expect(disassembler().verify(result.image.data(), result.image.size(), verifier) == SIZE_MAX, "the image doesn't survive disassembly");
+
+    size_t records = result.instruction_count();
+    optimizer::optimize(result);
+    expect(result.errors == 0 && result.instruction_count() <= records, "the optimizer added records or errors");
+    expect(disassembler().verify(result.image.data(), result.image.size(), verifier) == SIZE_MAX, "the optimized image doesn't survive disassembly");
+
+    return result.image.size();
+}
+
+#if KODA_ASM_LIBFUZZER
+
+extern "C" int LLVMFuzzerTestOneInput (const uint8_t* data, size_t size) {
+    assemble_input(string_view((const char*)data, size));
+    return 0;
+}
+
+#else
+
+/// Heap allocations made by the calling thread
+thread_local size_t allocation_count = 0;
+
+/// Every form of new counts and allocates through here, so every form of delete can use release()
+void* counted_allocation (size_t size, size_t alignment) {
+    allocation_count++;
+    if (size == 0) size = 1;
+    if (alignment <= alignof(std::max_align_t)) return malloc(size);
+    return aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+void* operator new (size_t size) {
+    if (void* pointer = counted_allocation(size, 0)) return pointer;
+    throw std::bad_alloc();
+}
+
+void* operator new (size_t size, std::align_val_t alignment) {
+    if (void* pointer = counted_allocation(size, (size_t)alignment)) return pointer;
+    throw std::bad_alloc();
+}
+
+void* operator new[] (size_t size) { return operator new(size); }
+void* operator new[] (size_t size, std::align_val_t alignment) { return operator new(size, alignment); }
+void* operator new (size_t size, const std::nothrow_t&) noexcept { return counted_allocation(size, 0); }
+void* operator new[] (size_t size, const std::nothrow_t&) noexcept { return counted_allocation(size, 0); }
+void* operator new (size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return counted_allocation(size, (size_t)alignment); }
+void* operator new[] (size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return counted_allocation(size, (size_t)alignment); }
+
+/// Not inlined, so GCC doesn't see free() paired with operator new and warn about a mismatch
+[[gnu::noinline]] void release (void* pointer) noexcept { free(pointer); }
+
+void operator delete (void* pointer) noexcept { release(pointer); }
+void operator delete[] (void* pointer) noexcept { release(pointer); }
+void operator delete (void* pointer, size_t) noexcept { release(pointer); }
+void operator delete[] (void* pointer, size_t) noexcept { release(pointer); }
+void operator delete (void* pointer, std::align_val_t) noexcept { release(pointer); }
+void operator delete[] (void* pointer, std::align_val_t) noexcept { release(pointer); }
+void operator delete (void* pointer, size_t, std::align_val_t) noexcept { release(pointer); }
+void operator delete[] (void* pointer, size_t, std::align_val_t) noexcept { release(pointer); }
+void operator delete (void* pointer, const std::nothrow_t&) noexcept { release(pointer); }
+void operator delete[] (void* pointer, const std::nothrow_t&) noexcept { release(pointer); }
+void operator delete (void* pointer, std::align_val_t, const std::nothrow_t&) noexcept { release(pointer); }
+void operator delete[] (void* pointer, std::align_val_t, const std::nothrow_t&) noexcept { release(pointer); }
+
+/// The measurements of one replayed input
+struct replay_result {
+    string path;
+    size_t size = 0;
+    size_t output = 0;
+    size_t allocations = 0;
+    double seconds = 0;
+
+    /// Seconds per input byte, with small inputs counted as min_bytes so fixed costs don't dominate.
+    /// Output isn't counted, so inputs that blow up (like macro bombs) show as slow.
+    double rate (size_t min_bytes) const {
+        return seconds / (double)std::max(size, min_bytes);
+    }
+};
+
+bool read_input (const string& path, string& text) {
+    ifstream file = ifstream(path, std::ios::binary);
+    if (!file) return false;
+    text.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return true;
+}
+
+/// Collect the files to replay, with directories expanded recursively and sorted
+void collect_inputs (const string& path, vector<string>& inputs) {
+    std::error_code error;
+    if (!filesystem::is_directory(path, error)) {
+        inputs.push_back(path);
+        return;
+    }
+
+    vector<string> found;
+    for (const auto& entry : filesystem::recursive_directory_iterator(path, error)) {
+        if (entry.is_regular_file()) found.push_back(entry.path().string());
+    }
+    std::sort(found.begin(), found.end());
+    inputs.insert(inputs.end(), found.begin(), found.end());
+}
+
+/// Keeps the compiler from dropping the repeated runs
+volatile size_t output_sink = 0;
+
+/// Run an input once to count its allocations, then repeatedly for at least min_time seconds
+replay_result replay (const string& path, const string& text, double min_time) {
+    replay_result entry = replay_result();
+    entry.path = path;
+    entry.size = text.size();
+
+    size_t before = allocation_count;
+    entry.output = assemble_input(text);
+    entry.allocations = allocation_count - before;
+
+    size_t runs = 0;
+    auto start = std::chrono::steady_clock::now();
+    double elapsed = 0;
+    do {
+        output_sink = assemble_input(text);
+        runs++;
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (elapsed < min_time && runs < 1000);
+
+    entry.seconds = elapsed / (double)runs;
+    return entry;
+}
+
+int main (int argc, char* argv[]) {
+    vector<string> inputs;
+    double slow_factor = 20;
+    size_t min_bytes = 256;
+    double min_time = 0.002;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--slow-factor" && i + 1 < argc) slow_factor = atof(argv[++i]);
+        else if (arg == "--min-bytes" && i + 1 < argc) min_bytes = std::max<size_t>(1, (size_t)atoll(argv[++i]));
+        else if (arg == "--min-time" && i + 1 < argc) min_time = atof(argv[++i]) / 1000;
+        else collect_inputs(arg, inputs);
+    }
+
+    if (inputs.empty()) {
+        cout << "Usage: koda_asm_fuzz <file or directory>... [--slow-factor 20] [--min-bytes 256] [--min-time <ms>]" << endl;
+        return 1;
+    }
+
+    vector<replay_result> results;
+    size_t total_bytes = 0;
+    for (const string& path : inputs) {
+        string text;
+        if (!read_input(path, text)) {
+            cout << cout_err("Unable to read " << path << ".") << endl;
+            return 2;
+        }
+
+        results.push_back(replay(path, text, min_time));
+        total_bytes += text.size();
+    }
+
+    // Inputs are compared with the median rate, so a slow machine doesn't flag everything
+    vector<double> rates;
+    for (const replay_result& entry : results) rates.push_back(entry.rate(min_bytes));
+    std::nth_element(rates.begin(), rates.begin() + (long)(rates.size() / 2), rates.end());
+    double median = rates[rates.size() / 2];
+
+    cout << "Replayed " << plural_num_string("input", (long long)results.size()) << " (" << total_bytes << " bytes) without failures." << endl;
+    cout << std::fixed << std::setprecision(1) << "Median: " << (median * 1e9) << " ns per byte." << endl;
+
+    const replay_result* most_allocating = &results[0];
+    size_t slow = 0;
+    for (const replay_result& entry : results) {
+        if ((double)entry.allocations / (double)std::max(entry.size, min_bytes) > (double)most_allocating->allocations / (double)std::max(most_allocating->size, min_bytes)) most_allocating = &entry;
+        if (entry.rate(min_bytes) <= median * slow_factor) continue;
+
+        if (slow++ == 0) cout << "\nSlow inputs (over " << slow_factor << "x the median):" << endl;
+        cout << "  " << entry.path << ": " << entry.size << " bytes in, " << entry.output << " bytes out, "
+             << (entry.seconds * 1e3) << " ms, " << (entry.rate(min_bytes) / median) << "x, " << entry.allocations << " allocations" << endl;
+    }
+
+    cout << "Most allocations: " << most_allocating->path << " with " << most_allocating->allocations << " for " << most_allocating->size << " bytes." << endl;
+    return slow > 0 ? 3 : 0;
+}
+
+#endif
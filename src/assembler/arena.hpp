@@ -0,0 +1,86 @@
+#pragma once
+#include "../shared.hpp"
+
+/// The size of the first block an arena takes from the heap
+#define ARENA_FIRST_BLOCK (64 * 1024)
+
+/// A bump allocator for everything one assembly job allocates.
+/// Deallocation does nothing, memory is only given back all at once by reset(), which keeps the blocks for the next job.
+/// After the first few jobs an arena has grown to the largest job and stops allocating from the heap at all,
+/// so jobs on different threads no longer contend for the global allocator. An arena is not thread-safe.
+class arena : public std::pmr::memory_resource {
+    protected:
+        struct block {
+            byte* data = nullptr;
+            size_t size = 0;
+        };
+
+        vector<block> blocks = vector<block>();
+
+        /// The block being allocated from and the offset of its free space
+        size_t current = 0;
+        size_t offset = 0;
+
+        size_t used_before = 0;
+        size_t peak = 0;
+
+        void* do_allocate (size_t size, size_t alignment) override {
+            while (current < blocks.size()) {
+                block& entry = blocks[current];
+                uintptr_t base = (uintptr_t)entry.data;
+                size_t start = (size_t)(((base + offset + alignment - 1) & ~(uintptr_t)(alignment - 1)) - base);
+                if (start + size <= entry.size) {
+                    offset = start + size;
+                    peak = std::max(peak, used_before + offset);
+                    return entry.data + start;
+                }
+
+                // The rest of this block is skipped until the next reset
+                used_before += entry.size;
+                current++;
+                offset = 0;
+            }
+
+            // Blocks double in size, so a job needs a logarithmic number of them
+            size_t grown = blocks.empty() ? ARENA_FIRST_BLOCK : blocks.back().size * 2;
+            block entry = block { nullptr, std::max(grown, size + alignment) };
+            entry.data = (byte*)::operator new(entry.size, std::align_val_t(alignof(std::max_align_t)));
+            blocks.push_back(entry);
+            current = blocks.size() - 1;
+            return do_allocate(size, alignment);
+        }
+
+        void do_deallocate (void*, size_t, size_t) override {}
+
+        bool do_is_equal (const std::pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
+
+    public:
+        arena () = default;
+        arena (const arena&) = delete;
+        arena& operator= (const arena&) = delete;
+
+        ~arena () override {
+            for (const block& entry : blocks) ::operator delete(entry.data, std::align_val_t(alignof(std::max_align_t)));
+        }
+
+        /// Free everything allocated so far, keeping the blocks. Nothing allocated from the arena may be used afterwards.
+        void reset () {
+            current = 0;
+            offset = 0;
+            used_before = 0;
+        }
+
+        /// The bytes taken from the heap, which are kept until the arena is destroyed
+        size_t capacity () const {
+            size_t total = 0;
+            for (const block& entry : blocks) total += entry.size;
+            return total;
+        }
+
+        /// The most bytes that were in use at once, including skipped block ends
+        size_t peak_usage () const {
+            return peak;
+        }
+};
@@ -0,0 +1,215 @@
+#pragma once
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+#include "../shared.hpp"
+#include "tokenizer.hpp"
+#include "emitter.hpp"
+#include "binary_io.hpp"
+
+/// The number of source lines in one cache block
+#define CACHE_BLOCK_LINES 1024
+
+/// Identifies a cache file, followed by the format version
+#define CACHE_MAGIC "KODACACHE"
+#define CACHE_VERSION 3
+
+/// A cache of encoded source blocks, stored next to the output as <target>.cache.
+/// Blocks are fixed runs of CACHE_BLOCK_LINES lines, keyed by a hash of their text.
+/// Only blocks that neither define nor use labels are cached, since only those encode the same way anywhere in a file.
+/// Blocks with .incbin aren't cached either, since their output depends on another file.
+/// The data ranges of a block are kept relative to its first record, so -O leaves them alone on a hit as well.
+class assembly_cache {
+    public:
+        struct block {
+            uint32_t lines = 0;
+            uint32_t comments = 0;
+            uint32_t todos = 0;
+
+            /// Pairs of uint32 offset and size of the block's data ranges
+            string_view ranges;
+            string_view bytes;
+        };
+
+        /// Statistics of the last tokenize() call
+        size_t blocks_total = 0;
+        size_t blocks_reused = 0;
+
+    protected:
+        source_file file = source_file();
+        unordered_map<uint64_t, block> blocks = unordered_map<uint64_t, block>();
+        unordered_set<uint64_t> written = unordered_set<uint64_t>();
+
+        /// Add a block to a cache file buffer, returning the number of blocks added
+        int store_block (vector<byte>& output, uint64_t hash, const block& entry) {
+            if (!written.insert(hash).second) return 0;
+
+            binary_io::write_value<uint64_t>(output, hash);
+            binary_io::write_value<uint32_t>(output, entry.lines);
+            binary_io::write_value<uint32_t>(output, entry.comments);
+            binary_io::write_value<uint32_t>(output, entry.todos);
+            binary_io::write_value<uint32_t>(output, (uint32_t)(entry.ranges.size() / (2 * sizeof(uint32_t))));
+            output.insert(output.end(), entry.ranges.begin(), entry.ranges.end());
+            binary_io::write_value<uint32_t>(output, (uint32_t)entry.bytes.size());
+            output.insert(output.end(), entry.bytes.begin(), entry.bytes.end());
+            return 1;
+        }
+
+    public:
+        /// Hash a block of source text, eight bytes at a time
+        static uint64_t hash_text (string_view text) {
+            uint64_t hash = 0x9E3779B97F4A7C15ull ^ text.size();
+
+            size_t i = 0;
+            for (; i + 8 <= text.size(); i += 8) {
+                uint64_t word;
+                memcpy(&word, text.data() + i, 8);
+                hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+                hash ^= hash >> 32;
+            }
+
+            uint64_t tail = 0;
+            memcpy(&tail, text.data() + i, text.size() - i);
+            hash = (hash ^ tail) * 0xC4CEB9FE1A85EC53ull;
+            return hash ^ (hash >> 29);
+        }
+
+        /// Load a cache file. A missing or invalid file leaves the cache empty.
+        bool load (const string& filename) {
+            blocks.clear();
+            if (!file_exists(filename) || !file.open_file(filename)) return false;
+
+            string_view data = file.text();
+            if (data.substr(0, strlen(CACHE_MAGIC)) != CACHE_MAGIC) return false;
+            data.remove_prefix(strlen(CACHE_MAGIC));
+
+            uint32_t version, block_lines, count;
+            if (!binary_io::read_value(data, &version) || version != CACHE_VERSION) return false;
+            if (!binary_io::read_value(data, &block_lines) || block_lines != CACHE_BLOCK_LINES) return false;
+            if (!binary_io::read_value(data, &count)) return false;
+
+            for (uint32_t i = 0; i < count; i++) {
+                uint64_t hash; block entry; uint32_t range_count, size;
+                if (!binary_io::read_value(data, &hash) || !binary_io::read_value(data, &entry.lines) || !binary_io::read_value(data, &entry.comments)) break;
+                if (!binary_io::read_value(data, &entry.todos) || !binary_io::read_value(data, &range_count)) break;
+                if (data.size() / (2 * sizeof(uint32_t)) < range_count) break;
+                entry.ranges = data.substr(0, range_count * 2 * sizeof(uint32_t));
+                data.remove_prefix(entry.ranges.size());
+
+                if (!binary_io::read_value(data, &size) || data.size() < size || size % INSTR_FULL_SIZE != 0) break;
+
+                entry.bytes = data.substr(0, size);
+                blocks[hash] = entry;
+                data.remove_prefix(size);
+            }
+
+            return true;
+        }
+
+    protected:
+        /// Tokenize the text block by block, adding every cacheable block to the new cache file buffer
+        void tokenize_blocks (assembly_tokenizer& tokenizer, string_view text, tokenizer_result* result, vector<byte>& output) {
+            result->reserve_instructions((size_t)std::count(text.begin(), text.end(), '\n') + 1);
+
+            output.insert(output.end(), CACHE_MAGIC, CACHE_MAGIC + strlen(CACHE_MAGIC));
+            binary_io::write_value<uint32_t>(output, CACHE_VERSION);
+            binary_io::write_value<uint32_t>(output, CACHE_BLOCK_LINES);
+            binary_io::write_value<uint32_t>(output, 0);
+            uint32_t stored = 0;
+
+            blocks_total = 0;
+            blocks_reused = 0;
+            written.clear();
+
+            // Blocks that aren't cached are tokenized into the same part, which keeps its memory between them
+            tokenizer_result part = tokenizer_result(result->image.get_allocator().resource());
+            part.source_name = result->source_name;
+            part.diagnostic_limit = result->diagnostic_limit;
+            vector<byte> ranges = vector<byte>();
+
+            size_t start = 0; int first_line = 1;
+            while (start < text.size()) {
+                // Find the end of the block
+                size_t end = start;
+                for (int i = 0; i < CACHE_BLOCK_LINES && end < text.size(); i++) {
+                    end = text.find('\n', end);
+                    end = (end == string_view::npos) ? text.size() : end + 1;
+                }
+
+                string_view block_text = text.substr(start, end - start);
+                uint64_t hash = hash_text(block_text);
+                blocks_total++;
+
+                auto cached = blocks.find(hash);
+                if (cached != blocks.end()) {
+                    const block& entry = cached->second;
+                    size_t base = result->output_size();
+                    for (size_t i = 0; i < entry.ranges.size(); i += 2 * sizeof(uint32_t)) {
+                        uint32_t range[2];
+                        memcpy(range, entry.ranges.data() + i, sizeof(range));
+                        result->add_data_range(data_range { base + range[0], range[1] });
+                    }
+                    result->image.insert(result->image.end(), entry.bytes.begin(), entry.bytes.end());
+                    result->lines += entry.lines;
+                    result->comments += entry.comments;
+                    result->todos += (int)entry.todos;
+                    blocks_reused++;
+
+                    stored += store_block(output, hash, entry);
+                } else {
+                    part.clear();
+                    tokenizer.tokenize_text(block_text, first_line, &part);
+                    result->append(part);
+
+                    // Included binaries can change without the block text changing
+                    if (part.errors == 0 && part.symbols.size() == 0 && block_text.find(".incbin") == string_view::npos) {
+                        ranges.clear();
+                        for (const data_range& range : part.data) {
+                            binary_io::write_value<uint32_t>(ranges, (uint32_t)range.offset);
+                            binary_io::write_value<uint32_t>(ranges, (uint32_t)range.size);
+                        }
+
+                        string_view bytes = string_view((const char*)part.image.data(), part.image.size());
+                        string_view range_bytes = string_view((const char*)ranges.data(), ranges.size());
+                        stored += store_block(output, hash, block { (uint32_t)part.lines, (uint32_t)part.comments, (uint32_t)part.todos, range_bytes, bytes });
+                    }
+                }
+
+                start = end;
+                first_line += CACHE_BLOCK_LINES;
+            }
+
+            memcpy(&output[strlen(CACHE_MAGIC) + 2 * sizeof(uint32_t)], &stored, sizeof(uint32_t));
+        }
+
+    public:
+        /// Tokenize a source file, taking every unchanged block from the cache and updating the cache file afterwards
+        bool tokenize (assembly_tokenizer& tokenizer, const source_file& source, tokenizer_result* result, const string& filename) {
+            // A block's output depends on the macros and includes before it, so such files aren't cached.
+            // Cached blocks don't know the lines of their records either, so there's no cache with a source map.
+            if (assembly_tokenizer::has_directives(source.text()) || result->keep_source_map) {
+                blocks_total = 0;
+                blocks_reused = 0;
+                return tokenizer.tokenize_file(source, result);
+            }
+
+            vector<byte> output = vector<byte>();
+            {
+                phase_timer timer = phase_timer(tokenizer.stats, assembly_phase::tokenize);
+                load(filename);
+                tokenize_blocks(tokenizer, source.text(), result, output);
+            }
+
+            {
+                phase_timer timer = phase_timer(tokenizer.stats, assembly_phase::resolve);
+                result->resolve_symbols();
+            }
+
+            // The old mapping must be released before the file is replaced
+            blocks.clear();
+            file.close();
+
+            phase_timer timer = phase_timer(tokenizer.stats, assembly_phase::write);
+            return emitter::write_image(filename, output.data(), output.size());
+        }
+};
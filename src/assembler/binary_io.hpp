@@ -0,0 +1,22 @@
+#pragma once
+#include <cstring>
+#include "../shared.hpp"
+
+/// Reading and writing the fixed-size little-endian fields of the cache and object file formats
+namespace binary_io {
+
+    template <typename T>
+    void write_value (vector<byte>& buffer, T value) {
+        const byte* bytes = (const byte*)&value;
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+    }
+
+    /// Read a value from the front of data and skip past it, returning false if data is too short
+    template <typename T>
+    bool read_value (string_view& data, T* value) {
+        if (data.size() < sizeof(T)) return false;
+        memcpy(value, data.data(), sizeof(T));
+        data.remove_prefix(sizeof(T));
+        return true;
+    }
+}
@@ -10,12 +10,13 @@
 /// The size of the instruction body, in bytes
 #define INSTR_DATA_SIZE (INSTR_FULL_SIZE - INSTR_ADDR_SIZE)
 
-struct bytecode_instruction {
-    ushort code = 0;
-    array<byte, INSTR_DATA_SIZE> data = array<byte, INSTR_DATA_SIZE>();
-
-    bytecode_instruction() = default;
-    explicit bytecode_instruction(ushort _code) {
-        this->code = _code;
-    }
-};
\ No newline at end of file
+/// Convert an opcode from host to big-endian (file) byte order
+inline ushort to_big_endian (ushort value) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return value;
+#elif defined(_MSC_VER)
+    return _byteswap_ushort(value);
+#else
+    return __builtin_bswap16(value);
+#endif
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include "../shared.hpp"
+
+/// What kind of problem a diagnostic reports
+enum class diagnostic_code : byte {
+    unknown_instruction,
+    argument_count,
+    invalid_number,
+    number_overflow,
+    invalid_label,
+    duplicate_label,
+    undefined_label,
+    label_range,
+    unseekable_output,
+    unknown_directive,
+    include_error,
+    macro_error,
+};
+
+constexpr const char* diagnostic_names[] = {
+    "unknown-instruction", "argument-count", "invalid-number", "number-overflow",
+    "invalid-label", "duplicate-label", "undefined-label", "label-range",
+    "unseekable-output", "unknown-directive", "include-error", "macro-error",
+};
+
+/// One problem found while tokenizing
+struct diagnostic {
+    int line = 0;
+
+    /// The 1-based column of the offending token, or 0 if it doesn't apply
+    int column = 0;
+    diagnostic_code code = diagnostic_code::unknown_instruction;
+    string message;
+
+    /// The include file the problem is in, empty for the source itself
+    string file;
+};
+
+/// Whether a diagnostic comes before another, by file and position
+inline bool diagnostic_before (const diagnostic& a, const diagnostic& b) {
+    if (a.file != b.file) return a.file < b.file;
+    return (a.line != b.line) ? (a.line < b.line) : (a.column < b.column);
+}
+
+/// Sort diagnostics by file and position, keeping only the first `limit`
+inline void sort_diagnostics (vector<diagnostic>& records, size_t limit) {
+    std::stable_sort(records.begin(), records.end(), diagnostic_before);
+    if (records.size() > limit) records.resize(limit);
+}
+
+/// Format diagnostics into one buffer, sorted by file and position.
+/// At most `limit` records are printed, followed by a summary of the rest (of `total`).
+string format_diagnostics (vector<diagnostic> records, long long total, size_t limit, const string& source_name) {
+    sort_diagnostics(records, limit);
+
+    string buffer;
+    size_t shown = records.size();
+    for (size_t i = 0; i < shown; i++) {
+        const diagnostic& record = records[i];
+
+        if (!record.file.empty()) buffer += record.file + ": ";
+        else if (!source_name.empty()) buffer += source_name + ": ";
+        buffer += "Tokenizer error on line " + str(record.line);
+        if (record.column > 0) buffer += ", column " + str(record.column);
+        buffer += ": " + record.message + " [" + diagnostic_names[(size_t)record.code] + "]\n";
+    }
+
+    if (total > (long long)shown) {
+        if (!source_name.empty()) buffer += source_name + ": ";
+        buffer += "... " + str(total - (long long)shown) + " more " + (total - (long long)shown == 1 ? "error" : "errors") + " not shown.\n";
+    }
+
+    return buffer;
+}
@@ -0,0 +1,181 @@
+#pragma once
+#include "../shared.hpp"
+#include "opcodes.hpp"
+#include "tokenizer.hpp"
+#include "../thread_pool.hpp"
+
+/// The number of records decoded by one thread at a time
+#define DISASM_CHUNK_RECORDS (64 * 1024)
+
+/// Turns an image back into canonical assembly, using the layout from opcode_table.
+/// Every record becomes one line: the mnemonic followed by its operands, registers in decimal and everything else in hex.
+/// Records that can't be reproduced by any instruction become a .word directive with their bytes, so the text still reassembles to the same image.
+class disassembler {
+    public:
+        unsigned int threads = 1;
+
+        /// Statistics of the last disassemble() or verify() call
+        size_t records = 0;
+        size_t data_records = 0;
+
+        /// Bytes after the last whole record, which can't be reassembled
+        size_t trailing_bytes = 0;
+
+        explicit disassembler (unsigned int threads = 1) : threads(std::max(1u, threads)) {}
+
+        /// Append the canonical assembly of one record to the text. Returns false if it isn't an instruction and was written as data.
+        static bool decode_record (const byte* record, string& text) {
+            using namespace instructions;
+
+            const opcode_spec* spec = find_opcode((ushort)((record[0] << 8) | record[1]));
+            const byte* data = record + INSTR_ADDR_SIZE;
+            if (spec == nullptr || !padding_clear(*spec, data)) {
+                text += ".word";
+                for (int i = 0; i < INSTR_FULL_SIZE; i += 2) {
+                    text += ' ';
+                    append_hex((record[i] << 8) | record[i + 1], 4, text);
+                }
+                text += '\n';
+                return false;
+            }
+
+            text += spec->mnemonic;
+            int offset = 0;
+            for (int i = 0; i < spec->operand_count; i++) {
+                text += ' ';
+                switch (spec->operands[i]) {
+                    case reg8: append_decimal(data[offset], text); break;
+                    case addr16: append_hex((data[offset] << 8) | data[offset + 1], 4, text); break;
+                    default: append_hex(data[offset], 2, text); break;
+                }
+                offset += operand_sizes[spec->operands[i]];
+            }
+            text += '\n';
+            return true;
+        }
+
+        /// Disassemble an image, passing the text to sink in order, one chunk at a time
+        template <typename F>
+        void disassemble (const byte* data, size_t size, F sink) {
+            records = size / INSTR_FULL_SIZE;
+            data_records = 0;
+            trailing_bytes = size % INSTR_FULL_SIZE;
+
+            vector<string> texts = vector<string>(threads);
+            vector<size_t> data_counts = vector<size_t>(threads, 0);
+            for_each_round([&](size_t chunks, size_t first) {
+                run_chunks(chunks, [&](size_t i) {
+                    texts[i].clear();
+                    data_counts[i] = decode_chunk(data, first + i * DISASM_CHUNK_RECORDS, texts[i]);
+                });
+
+                for (size_t i = 0; i < chunks; i++) {
+                    data_records += data_counts[i];
+                    sink(string_view(texts[i]));
+                }
+            });
+
+            if (trailing_bytes != 0) {
+                string text = "; trailing bytes:";
+                append_bytes(data + records * INSTR_FULL_SIZE, trailing_bytes, text);
+                text += '\n';
+                sink(string_view(text));
+            }
+        }
+
+        /// Disassemble an image and assemble the text again, one chunk at a time.
+        /// Returns the index of the first record that doesn't come out the same, or SIZE_MAX if the image round-trips exactly.
+        size_t verify (const byte* data, size_t size, assembly_tokenizer& tokenizer) {
+            records = size / INSTR_FULL_SIZE;
+            data_records = 0;
+            trailing_bytes = size % INSTR_FULL_SIZE;
+
+            size_t mismatch = SIZE_MAX;
+            vector<size_t> first_mismatch = vector<size_t>(threads);
+            vector<size_t> data_counts = vector<size_t>(threads, 0);
+            for_each_round([&](size_t chunks, size_t first) {
+                if (mismatch != SIZE_MAX) return;
+
+                run_chunks(chunks, [&](size_t i) {
+                    size_t start = first + i * DISASM_CHUNK_RECORDS;
+                    string text;
+                    data_counts[i] = decode_chunk(data, start, text);
+
+                    tokenizer_result part = tokenizer_result();
+                    part.reserve_instructions(std::min<size_t>(DISASM_CHUNK_RECORDS, records - start));
+                    tokenizer.tokenize_text(text, 1, &part);
+                    first_mismatch[i] = compare(data + start * INSTR_FULL_SIZE, std::min<size_t>(DISASM_CHUNK_RECORDS, records - start), part.image);
+                    if (first_mismatch[i] != SIZE_MAX) first_mismatch[i] += start;
+                });
+
+                for (size_t i = 0; i < chunks; i++) {
+                    data_records += data_counts[i];
+                    if (mismatch == SIZE_MAX) mismatch = first_mismatch[i];
+                }
+            });
+
+            if (mismatch == SIZE_MAX && trailing_bytes != 0) mismatch = records;
+            return mismatch;
+        }
+
+    private:
+        /// Run the task for each round of up to `threads` chunks, with the number of chunks and the first record of the round
+        template <typename F>
+        void for_each_round (F task) {
+            size_t round = (size_t)DISASM_CHUNK_RECORDS * threads;
+            for (size_t first = 0; first < records; first += round) {
+                size_t count = std::min(round, records - first);
+                task((count + DISASM_CHUNK_RECORDS - 1) / DISASM_CHUNK_RECORDS, first);
+            }
+        }
+
+        /// Decode the chunk starting at the given record, returning the number of data records
+        size_t decode_chunk (const byte* data, size_t first, string& text) const {
+            size_t end = std::min<size_t>(first + DISASM_CHUNK_RECORDS, records);
+            text.reserve((end - first) * 16);
+
+            size_t data_count = 0;
+            for (size_t i = first; i < end; i++) {
+                if (!decode_record(data + i * INSTR_FULL_SIZE, text)) data_count++;
+            }
+            return data_count;
+        }
+
+        /// Compare the records of a chunk with a reassembled image, returning the index of the first difference or SIZE_MAX
+        static size_t compare (const byte* data, size_t count, const pmr::vector<byte>& image) {
+            size_t same = std::min(count, image.size() / INSTR_FULL_SIZE);
+            if (same == count && image.size() == count * INSTR_FULL_SIZE && memcmp(data, image.data(), image.size()) == 0) return SIZE_MAX;
+
+            for (size_t i = 0; i < same; i++) {
+                if (memcmp(data + i * INSTR_FULL_SIZE, &image[i * INSTR_FULL_SIZE], INSTR_FULL_SIZE) != 0) return i;
+            }
+            return same;
+        }
+
+        /// Check that the data bytes not used by the operands are zero, as the assembler leaves them
+        static bool padding_clear (const instructions::opcode_spec& spec, const byte* data) {
+            for (int i = spec.data_size(); i < INSTR_DATA_SIZE; i++) {
+                if (data[i] != 0) return false;
+            }
+            return true;
+        }
+
+        static void append_decimal (uint value, string& text) {
+            char digits[4];
+            auto end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+            text.append(digits, end);
+        }
+
+        static void append_hex (uint value, int digits, string& text) {
+            static constexpr char HEX_DIGITS[] = "0123456789ABCDEF";
+            text += "0x";
+            for (int i = digits - 1; i >= 0; i--) text += HEX_DIGITS[(value >> (4 * i)) & 0xF];
+        }
+
+        static void append_bytes (const byte* data, size_t count, string& text) {
+            for (size_t i = 0; i < count; i++) {
+                text += ' ';
+                append_hex(data[i], 2, text);
+            }
+        }
+};
@@ -0,0 +1,33 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include "../shared.hpp"
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+namespace emitter {
+
+    /// Write an image with a single write call. A target of "-" writes to stdout.
+    bool write_image (const string& target, const byte* data, size_t size) {
+        bool to_stdout = (target == "-");
+
+        FILE* file;
+        if (to_stdout) {
+#ifdef _WIN32
+            _setmode(_fileno(stdout), _O_BINARY);
+#endif
+            file = stdout;
+        } else {
+            file = fopen(target.c_str(), "wb");
+            if (file == nullptr) return false;
+        }
+
+        bool ok = (size == 0 || fwrite(data, 1, size, file) == size);
+        ok = (fflush(file) == 0) && ok;
+        if (!to_stdout) ok = (fclose(file) == 0) && ok;
+        return ok;
+    }
+}
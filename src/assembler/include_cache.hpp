@@ -0,0 +1,71 @@
+#pragma once
+#include <unordered_map>
+#include "../shared.hpp"
+#include "line_tokens.hpp"
+#include "source_file.hpp"
+
+/// One non-empty line of an include file or macro, split into tokens
+struct token_line {
+    line_tokens tokens;
+    int line = 0;
+};
+
+/// An include file, split into tokens once and then only read.
+/// The tokens are views into the mapped file, which stays open as long as the include_file does.
+struct include_file {
+    string path;
+    source_file source;
+    bool open = false;
+
+    vector<token_line> lines = vector<token_line>();
+    long long line_count = 0;
+    long long comments = 0;
+    int todos = 0;
+};
+
+/// Include files by path, each split into tokens the first time it is requested.
+/// The cache is thread-safe, so one instance can serve every file of a batch.
+class include_cache {
+    protected:
+        struct entry {
+            std::once_flag once;
+            shared_ptr<const include_file> file;
+        };
+
+        std::mutex lock;
+        unordered_map<string, shared_ptr<entry>> entries = unordered_map<string, shared_ptr<entry>>();
+
+    public:
+        /// The cache shared by everything assembled in this process
+        static include_cache& shared () {
+            static include_cache cache;
+            return cache;
+        }
+
+        /// Get an include file by its normalized path. The first request opens the file and calls split(file) to fill in its lines,
+        /// concurrent requests for the same file wait for that instead of doing it again.
+        template <typename F>
+        shared_ptr<const include_file> get (const string& path, F split) {
+            shared_ptr<entry> slot;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                shared_ptr<entry>& found = entries[path];
+                if (found == nullptr) found = make_shared<entry>();
+                slot = found;
+            }
+
+            std::call_once(slot->once, [&] {
+                shared_ptr<include_file> file = make_shared<include_file>();
+                file->path = path;
+                file->open = file->source.open_file(path);
+                if (file->open) split(*file);
+                slot->file = file;
+            });
+            return slot->file;
+        }
+
+        size_t size () {
+            std::lock_guard<std::mutex> guard(lock);
+            return entries.size();
+        }
+};
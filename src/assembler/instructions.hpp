@@ -1,364 +1,164 @@
 #pragma once
-#include "tokenizer.hpp"
-#include <ctgmath>
+#include "tokenizer_result.hpp"
+#include "opcodes.hpp"
 #include "../utils.hpp"
 
 namespace instructions {
-#define instr_tokenizer_no_args(__name, __code) \
-instr_tokenizer(__name, { \
-    if (validate_args(parts, 0, line, result)) return; \
-    auto instr = bytecode_instruction(__code); \
-    result->add_instruction(instr); \
-})
 
-    bool validate_args(const vector<string> &parts, int require, int line_num, tokenizer_result* result) {
+    bool validate_args(const line_tokens &parts, int require, int line_num, tokenizer_result* result) {
         if (parts.size() - 1 > require) {
             tokenize_error(line_num,
-                           "Too many arguments. Expected " + str(require) + ", got " + str(parts.size()-1), result);
+                           "Too many arguments. Expected " + str(require) + ", got " + str(parts.size()-1), result,
+                           diagnostic_code::argument_count, parts.column(require + 1));
             return true;
         }
         if (parts.size() - 1 < require) {
             tokenize_error(line_num,
-                           "Not enough arguments. Expected " + str(require) + ", got " + str(parts.size()-1), result);
+                           "Not enough arguments. Expected " + str(require) + ", got " + str(parts.size()-1), result,
+                           diagnostic_code::argument_count, parts.column(0));
             return true;
         }
         return false;
     };
 
-    bool parse_number(const string &content, uint *value, int max_size, int line_num, tokenizer_result* result) {
-        if (content.rfind("0x", 0) == 0) {
-            // It's a hex value
-            std::stringstream stream;
-            uint buffer;
-            stream << std::hex << content.substr(2);
-            stream >> buffer;
-            *value = buffer;
+    /// The ways reading a number can fail
+    enum class number_error {
+        none,
+        empty,          // No digits after the prefix
+        malformed,      // A character that is not a digit of the base
+        overflow,       // The value does not fit into the requested size
+    };
 
+    /// Read a decimal, hexadecimal (0x) or binary (0b) literal that must fit into max_size bytes
+    number_error read_number(string_view content, uint *value, int max_size) {
+        int base = 10;
+        if (content.rfind("0x", 0) == 0) {
+            base = 16;
+            content.remove_prefix(2);
         } else if (content.rfind("0b", 0) == 0) {
-            // It's a binary value
-            *value = stoi(content.substr(2), nullptr, 2);
-
-        } else {
-            // It's a normal value
-            *value = stoi(content);
+            base = 2;
+            content.remove_prefix(2);
         }
 
-        if (*value > pow(2, (8 * max_size))) {
-            tokenize_error(line_num, "Value too large. Number must be " + str(max_size * 8) + "-bit", result);
-        }
+        *value = 0;
+        if (content.empty()) return number_error::empty;
 
-        return true;
-    };
+        uint buffer = 0;
+        auto parsed = std::from_chars(content.data(), content.data() + content.size(), buffer, base);
+        if (parsed.ec == std::errc::result_out_of_range) return number_error::overflow;
+        if (parsed.ec != std::errc() || parsed.ptr != content.data() + content.size()) return number_error::malformed;
 
-    void internal_put_x8 (const string& txt, byte* a, int line, tokenizer_result* result) {
-        uint value;
-        parse_number(txt, &value, 1, line, result);
-        *a = (byte)value;
-    }
-#define put_x8(txt, a) internal_put_x8(txt, a, line, result)
+        uint limit = (max_size >= (int)sizeof(uint)) ? UINT_MAX : ((1u << (8 * max_size)) - 1);
+        if (buffer > limit) return number_error::overflow;
 
-    void internal_put_x16 (const string& txt, byte* a, byte* b, int line, tokenizer_result* result) {
-        uint value;
-        parse_number(txt, &value, 2, line, result);
-        auto data_bytes = bin::short_to_bytes((short)value);
-        *a = (byte)data_bytes[0];
-        *b = (byte)data_bytes[1];
+        *value = buffer;
+        return number_error::none;
     }
-#define put_x16(txt, a, b) internal_put_x16(txt, a, b, line, result)
-
-#define instr_valid(num) if (validate_args(parts, num, line, result)) return;
-#define instr_init(code) auto instr = bytecode_instruction(code);
-#define instr_done() result->add_instruction(instr);
-
-    instr_tokenizer_no_args(base_noop, 0x0000)
-
-    instr_tokenizer_no_args(base_halt, 0x0001)
-
-    instr_tokenizer_no_args(base_panic, 0x0002)
-
-    instr_tokenizer(base_increment_register, {
-        instr_valid(1);
-        instr_init(0x0100);
-
-        // Register
-        put_x8(parts[1], &instr.data[0]);
-
-        instr_done();
-    })
-
-    instr_tokenizer(base_decrement_register, {
-        instr_valid(1);
-        instr_init(0x0101);
-
-        // Register
-        put_x8(parts[1], &instr.data[0]);
-
-        instr_done();
-    })
-
-    instr_tokenizer(base_store_into_register, {
-        instr_valid(2);
-        instr_init(0x0102);
-
-        // Register
-        put_x8(parts[1], &instr.data[0]);
-
-        // Value
-        put_x8(parts[2], &instr.data[1]);
-
-        instr_done();
-    })
-
-    instr_tokenizer(base_memory_to_register, {
-        instr_valid(2);
-        instr_init(0x0103);
-
-        // Register
-        put_x8(parts[1], &instr.data[0]);
-
-        // Address
-        put_x16(parts[2], &instr.data[1], &instr.data[2]);
-
-        instr_done();
-    })
-
-    instr_tokenizer(base_register_to_memory, {
-        instr_valid(2);
-        instr_init(0x0104);
-
-        // Register
-        put_x8(parts[1], &instr.data[0]);
-
-        // Address
-        put_x16(parts[2], &instr.data[1], &instr.data[2]);
-
-        instr_done();
-    })
-
-    instr_tokenizer(base_write_state_register, {
-        instr_valid(1);
-        instr_init(0x0110);
-
-        // Register
-        put_x8(parts[1], &instr.data[0]);
-
-        instr_done();
-    })
-    instr_tokenizer(base_read_state_register, {
-        instr_valid(1);
-        instr_init(0x0111);
-
-        // Register
-        put_x8(parts[1], &instr.data[0]);
-
-        instr_done();
-    })
-
-    instr_tokenizer(base_jump, {
-        instr_valid(1);
-        instr_init(0x0200);
-
-        // Address
-        put_x16(parts[1], &instr.data[0], &instr.data[1]);
-
-        instr_done();
-    })
-
-    instr_tokenizer(base_compare, {
-        instr_valid(2);
-        instr_init(0x0300);
-
-        // Register A
-        put_x8(parts[1], &instr.data[0]);
-
-        // Register B
-        put_x8(parts[2], &instr.data[1]);
-
-        instr_done();
-    })
-
-    instr_tokenizer(base_compare_x16, {
-        instr_valid(4);
-        instr_init(0x0301);
-
-        // Register A
-        put_x8(parts[1], &instr.data[0]);
-
-        // Register B
-        put_x8(parts[2], &instr.data[1]);
-
-        // Register C
-        put_x8(parts[3], &instr.data[2]);
-
-        // Register D
-        put_x8(parts[4], &instr.data[3]);
-
-        instr_done();
-    })
-
-    instr_tokenizer(base_jump_compare, {
-        instr_valid(2);
-        instr_init(0x0201);
-
-        // Register
-        put_x8(parts[1], &instr.data[0]);
-
-        // Address
-        put_x16(parts[2], &instr.data[1], &instr.data[2]);
-
-        instr_done();
-    })
 
-    // #################################################
-
-    instr_tokenizer(alu_add, {
-        instr_valid(2);
-        instr_init(0x0310);
-
-        // Register A
-        put_x8(parts[1], &instr.data[0]);
-
-        // Register B
-        put_x8(parts[2], &instr.data[1]);
-
-        // Out Register
-        put_x8(parts[3], &instr.data[2]);
-
-        instr_done();
-    })
-
-    instr_tokenizer(alu_sub, {
-        instr_valid(2);
-        instr_init(0x0311);
-
-        // Register A
-        put_x8(parts[1], &instr.data[0]);
-
-        // Register B
-        put_x8(parts[2], &instr.data[1]);
-
-        // Out Register
-        put_x8(parts[3], &instr.data[2]);
-
-        instr_done();
-    })
-
-    instr_tokenizer(alu_and, {
-        instr_valid(3);
-        instr_init(0x0312);
-
-        // Register A
-        put_x8(parts[1], &instr.data[0]);
-
-        // Register B
-        put_x8(parts[2], &instr.data[1]);
-
-        // Out Register
-        put_x8(parts[3], &instr.data[2]);
-
-        instr_done();
-    })
-
-    instr_tokenizer(alu_or, {
-        instr_valid(3);
-        instr_init(0x0313);
-
-        // Register A
-        put_x8(parts[1], &instr.data[0]);
-
-        // Register B
-        put_x8(parts[2], &instr.data[1]);
-
-        // Out Register
-        put_x8(parts[3], &instr.data[2]);
-
-        instr_done();
-    })
-
-    instr_tokenizer(alu_not, {
-        instr_valid(2);
-        instr_init(0x0314);
-
-        // Register A
-        put_x8(parts[1], &instr.data[0]);
-
-        // Out Register
-        put_x8(parts[2], &instr.data[1]);
-
-        instr_done();
-    })
-
-    instr_tokenizer(alu_xor, {
-        instr_valid(3);
-        instr_init(0x0315);
-
-        // Register A
-        put_x8(parts[1], &instr.data[0]);
-
-        // Register B
-        put_x8(parts[2], &instr.data[1]);
-
-        // Out Register
-        put_x8(parts[3], &instr.data[2]);
-
-        instr_done();
-    })
-
-    instr_tokenizer(alu_shift_l, {
-        instr_valid(3);
-        instr_init(0x0316);
-
-        // Register A
-        put_x8(parts[1], &instr.data[0]);
-
-        // Register B
-        put_x8(parts[2], &instr.data[1]);
-
-        // Out Register
-        put_x8(parts[3], &instr.data[2]);
-
-        instr_done();
-    })
-
-    instr_tokenizer(alu_shift_r, {
-        instr_valid(3);
-        instr_init(0x0317);
-
-        // Register A
-        put_x8(parts[1], &instr.data[0]);
-
-        // Register B
-        put_x8(parts[2], &instr.data[1]);
-
-        // Out Register
-        put_x8(parts[3], &instr.data[2]);
+    /// Read a number literal, reporting a tokenizer error if it is invalid
+    bool parse_number(string_view content, uint *value, int max_size, int line_num, tokenizer_result* result, int column = 0) {
+        switch (read_number(content, value, max_size)) {
+            case number_error::none:
+                return true;
+            case number_error::empty:
+                tokenize_error(line_num, "Missing digits in number '" + string(content) + "'", result, diagnostic_code::invalid_number, column);
+                return false;
+            case number_error::malformed:
+                tokenize_error(line_num, "Invalid number '" + string(content) + "'", result, diagnostic_code::invalid_number, column);
+                return false;
+            case number_error::overflow:
+                tokenize_error(line_num, "Value too large. Number must be " + str(max_size * 8) + "-bit", result, diagnostic_code::number_overflow, column);
+                return false;
+        }
+        return false;
+    };
 
-        instr_done();
-    })
+    /// Check whether a token is a label name: a letter, '_' or '.' followed by letters, digits, '_' or '.'
+    bool is_label_name (string_view name) {
+        if (name.empty() || isdigit((byte)name[0])) return false;
+        for (char c : name) {
+            if (!isalnum((byte)c) && c != '_' && c != '.') return false;
+        }
+        return true;
+    }
 
-    // #######################
+    /// Encode one instruction line according to its opcode_spec.
+    /// Address operands may name a label, which is patched in once all labels are known.
+    void encode (const opcode_spec& spec, const line_tokens& parts, int line, tokenizer_result* result) {
+        if (validate_args(parts, spec.operand_count, line, result)) return;
+        byte* data = result->add_instruction(spec.code);
+        size_t data_offset = result->output_size() - INSTR_DATA_SIZE;
+
+        int offset = 0;
+        for (int i = 0; i < spec.operand_count; i++) {
+            int size = operand_sizes[spec.operands[i]];
+
+            if (spec.operands[i] == addr16 && is_label_name(parts[1 + i])) {
+                result->add_reference(parts[1 + i], data_offset + offset, line, parts.column(1 + i));
+                offset += size;
+                continue;
+            }
+
+            uint value;
+            parse_number(parts[1 + i], &value, size, line, result, parts.column(1 + i));
+
+            // Operands are stored big-endian
+            for (int b = 0; b < size; b++) {
+                data[offset + b] = (byte)(value >> (8 * (size - 1 - b)));
+            }
+            offset += size;
+        }
+    }
 
-    instr_tokenizer(ext_platform_info, {
-        instr_valid(2);
-        instr_init(0x1000);
+    /// The largest .fill, to catch typos before they allocate gigabytes
+    constexpr uint FILL_MAX_SIZE = 256u * 1024 * 1024;
 
-        // Register A
-        put_x8(parts[1], &instr.data[0]);
+    /// .byte and .word: values of the given size, stored big-endian one after another and padded to whole records.
+    /// Words may name a label, which is patched in like an address operand.
+    void encode_values (const line_tokens& parts, int size, int line, tokenizer_result* result) {
+        size_t count = parts.size() - 1;
+        if (count == 0) {
+            tokenize_error(line, "Expected at least one value", result, diagnostic_code::argument_count, parts.column(0));
+            return;
+        }
+        if (count > LINE_MAX_VALUES || parts.overflowed()) {
+            tokenize_error(line, "Too many values. At most " + str(LINE_MAX_VALUES) + " fit on one line", result, diagnostic_code::argument_count, parts.column(0));
+            return;
+        }
 
-        // Out Register
-        put_x8(parts[2], &instr.data[1]);
+        size_t start = result->output_size();
+        byte* data = result->add_data(count * size);
+        for (size_t i = 0; i < count; i++) {
+            if (size == 2 && is_label_name(parts[1 + i])) {
+                result->add_reference(parts[1 + i], start + i * size, line, parts.column(1 + i));
+                continue;
+            }
+
+            uint value;
+            parse_number(parts[1 + i], &value, size, line, result, parts.column(1 + i));
+            for (int b = 0; b < size; b++) {
+                data[i * size + b] = (byte)(value >> (8 * (size - 1 - b)));
+            }
+        }
+    }
 
-        instr_done();
-    })
+    /// .fill count [value]: count copies of a byte (zero by default), padded to whole records
+    void encode_fill (const line_tokens& parts, int line, tokenizer_result* result) {
+        if (parts.size() < 2 || parts.size() > 3) {
+            tokenize_error(line, "Expected .fill count [value]", result, diagnostic_code::argument_count, parts.column(0));
+            return;
+        }
 
-    instr_tokenizer(ext_invoke, {
-        instr_valid(INSTR_DATA_SIZE);
-        instr_init(0x1001);
+        uint count = 0, value = 0;
+        if (!parse_number(parts[1], &count, 4, line, result, parts.column(1))) return;
+        if (parts.size() == 3 && !parse_number(parts[2], &value, 1, line, result, parts.column(2))) return;
 
-        for (int i = 0; i < INSTR_DATA_SIZE; i++) {
-            put_x8(parts[1 + i], &instr.data[i]);
+        if (count > FILL_MAX_SIZE) {
+            tokenize_error(line, "Fill too large. At most " + str(FILL_MAX_SIZE) + " bytes", result, diagnostic_code::number_overflow, parts.column(1));
+            return;
         }
 
-        instr_done();
-    })
-}
\ No newline at end of file
+        if (value != 0) memset(result->add_data(count), (int)value, count);
+        else result->add_data(count);
+    }
+}
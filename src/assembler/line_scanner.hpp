@@ -0,0 +1,200 @@
+#pragma once
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define KODA_ASM_X86 1
+#else
+#define KODA_ASM_X86 0
+#endif
+
+#include "../shared.hpp"
+#include "line_tokens.hpp"
+
+/// Splits text into lines and tokens by classifying 64 bytes at a time.
+/// Spaces, tabs and carriage returns separate tokens, a token starting with ';' starts a comment that runs to the end of the line.
+namespace scanner {
+
+    /// One bit per byte of a 64-byte block
+    struct block_masks {
+        uint64_t space = 0;
+        uint64_t newline = 0;
+    };
+
+    constexpr size_t BLOCK_SIZE = 64;
+
+    /// The number of blocks classified by one call of the mask function
+    constexpr size_t BATCH_BLOCKS = 4;
+
+    /// Classify whole blocks of text
+    using mask_function = void (*)(const char* text, size_t blocks, block_masks* masks);
+
+    inline void masks_scalar (const char* text, size_t blocks, block_masks* masks) {
+        for (size_t b = 0; b < blocks; b++) {
+            block_masks mask = block_masks();
+            for (size_t i = 0; i < BLOCK_SIZE; i++) {
+                char c = text[b * BLOCK_SIZE + i];
+                if (c == ' ' || c == '\t' || c == '\r') mask.space |= 1ull << i;
+                else if (c == '\n') mask.newline |= 1ull << i;
+            }
+            masks[b] = mask;
+        }
+    }
+
+#if KODA_ASM_X86
+    inline void masks_sse2 (const char* text, size_t blocks, block_masks* masks) {
+        const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), carriage = _mm_set1_epi8('\r'), newline = _mm_set1_epi8('\n');
+        for (size_t b = 0; b < blocks; b++) {
+            block_masks mask = block_masks();
+            for (size_t i = 0; i < BLOCK_SIZE; i += 16) {
+                __m128i chunk = _mm_loadu_si128((const __m128i*)(text + b * BLOCK_SIZE + i));
+                __m128i spaces = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab)), _mm_cmpeq_epi8(chunk, carriage));
+                mask.space |= (uint64_t)(uint16_t)_mm_movemask_epi8(spaces) << i;
+                mask.newline |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)) << i;
+            }
+            masks[b] = mask;
+        }
+    }
+
+#if defined(__GNUC__)
+    __attribute__((target("avx2")))
+    inline void masks_avx2 (const char* text, size_t blocks, block_masks* masks) {
+        const __m256i space = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t'), carriage = _mm256_set1_epi8('\r'), newline = _mm256_set1_epi8('\n');
+        for (size_t b = 0; b < blocks; b++) {
+            block_masks mask = block_masks();
+            for (size_t i = 0; i < BLOCK_SIZE; i += 32) {
+                __m256i chunk = _mm256_loadu_si256((const __m256i*)(text + b * BLOCK_SIZE + i));
+                __m256i spaces = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, space), _mm256_cmpeq_epi8(chunk, tab)), _mm256_cmpeq_epi8(chunk, carriage));
+                mask.space |= (uint64_t)(uint32_t)_mm256_movemask_epi8(spaces) << i;
+                mask.newline |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline)) << i;
+            }
+            masks[b] = mask;
+        }
+    }
+#endif
+#endif
+
+    /// The fastest mask function the CPU supports
+    inline mask_function select_masks () {
+#if KODA_ASM_X86 && defined(__GNUC__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return masks_avx2;
+#endif
+#if KODA_ASM_X86
+        return masks_sse2;
+#else
+        return masks_scalar;
+#endif
+    }
+
+    /// The mask function in use, picked once at startup
+    inline mask_function compute_masks = select_masks();
+
+    inline int lowest_bit (uint64_t value) {
+#if defined(__GNUC__)
+        return __builtin_ctzll(value);
+#else
+        unsigned long index;
+        _BitScanForward64(&index, value);
+        return (int)index;
+#endif
+    }
+
+    /// Split text into lines, calling on_line(parts, comment, has_comment) for every line in order.
+    /// The tokens and comment are views into the text. A last line without a newline is included, an empty one after the last newline isn't.
+    template <typename F>
+    void scan_lines (string_view text, F on_line) {
+        const char* data = text.data();
+        size_t size = text.size();
+
+        line_tokens parts = line_tokens();
+        parts.line_start = data;
+        size_t line_begin = 0, token_start = 0, comment_start = 0;
+        bool in_token = false, in_comment = false;
+
+        // Whether the byte before the current block separates tokens
+        uint64_t previous_delimiter = 1;
+
+        block_masks batch[BATCH_BLOCKS];
+        char tail[BLOCK_SIZE];
+        for (size_t base = 0; base < size; base += BLOCK_SIZE * BATCH_BLOCKS) {
+            size_t blocks = std::min(BATCH_BLOCKS, (size - base) / BLOCK_SIZE);
+            if (blocks > 0) compute_masks(data + base, blocks, batch);
+
+            // The end of the text is copied into a block padded with spaces, so nothing is read past it
+            size_t rest = 0;
+            if (blocks < BATCH_BLOCKS && base + blocks * BLOCK_SIZE < size) {
+                rest = size - base - blocks * BLOCK_SIZE;
+                memset(tail, ' ', BLOCK_SIZE);
+                memcpy(tail, data + base + blocks * BLOCK_SIZE, rest);
+                compute_masks(tail, 1, batch + blocks);
+                blocks++;
+            }
+
+            for (size_t k = 0; k < blocks; k++) {
+                size_t offset = base + k * BLOCK_SIZE;
+                const block_masks& mask = batch[k];
+
+                uint64_t delimiter = mask.space | mask.newline;
+                uint64_t after_delimiter = (delimiter << 1) | previous_delimiter;
+                uint64_t starts = ~delimiter & after_delimiter;
+                uint64_t ends = delimiter & ~after_delimiter;
+                previous_delimiter = delimiter >> 63;
+
+                uint64_t valid = (rest != 0 && k == blocks - 1) ? ((1ull << rest) - 1) : ~0ull;
+                uint64_t events = (in_comment ? mask.newline : (starts | ends | mask.newline)) & valid;
+
+                while (events != 0) {
+                    int bit = lowest_bit(events);
+                    uint64_t flag = 1ull << bit;
+                    events &= events - 1;
+                    size_t position = offset + (size_t)bit;
+
+                    if (!in_comment) {
+                        if ((ends & flag) && in_token) {
+                            parts.push_back(string_view(data + token_start, position - token_start));
+                            in_token = false;
+                        }
+
+                        if (starts & flag) {
+                            if (data[position] == ';') {
+                                // Only the end of the line matters inside a comment
+                                in_comment = true;
+                                comment_start = position + 1;
+                                events &= mask.newline;
+                            } else {
+                                token_start = position;
+                                in_token = true;
+                            }
+                            continue;
+                        }
+                    }
+
+                    if (mask.newline & flag) {
+                        string_view comment = string_view();
+                        if (in_comment) {
+                            comment = string_view(data + comment_start, position - comment_start);
+                            if (!comment.empty() && comment.back() == '\r') comment.remove_suffix(1);
+                        }
+                        on_line(parts, comment, in_comment);
+
+                        parts = line_tokens();
+                        parts.line_start = data + position + 1;
+                        line_begin = position + 1;
+
+                        // Tokens after a comment were skipped, so they are picked up again from here
+                        if (in_comment) events |= (starts | ends | mask.newline) & valid & ~((flag << 1) - 1);
+                        in_comment = false;
+                    }
+                }
+            }
+        }
+
+        if (in_token) parts.push_back(string_view(data + token_start, size - token_start));
+        if (line_begin < size) {
+            string_view comment = in_comment ? string_view(data + comment_start, size - comment_start) : string_view();
+            if (!comment.empty() && comment.back() == '\r') comment.remove_suffix(1);
+            on_line(parts, comment, in_comment);
+        }
+    }
+}
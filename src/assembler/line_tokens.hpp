@@ -0,0 +1,50 @@
+#pragma once
+#include "../shared.hpp"
+
+/// The most values a .byte or .word line may hold
+#define LINE_MAX_VALUES 9
+
+/// The maximum number of tokens stored for a single line: a label, the instruction or directive name and its arguments.
+/// Enough for a label and a .byte directive with LINE_MAX_VALUES values.
+#define LINE_MAX_TOKENS (LINE_MAX_VALUES + 2)
+
+/// The tokens of a single source line, as views into the source text.
+/// Tokens past LINE_MAX_TOKENS are counted but not stored, so argument validation still sees them.
+struct line_tokens {
+    array<string_view, LINE_MAX_TOKENS> items = array<string_view, LINE_MAX_TOKENS>();
+    size_t count = 0;
+
+    /// The number of tokens held in items, less than count if some didn't fit
+    size_t stored = 0;
+
+    /// The start of the line the tokens were taken from, used for column numbers
+    const char* line_start = nullptr;
+
+    void push_back (string_view token) {
+        if (stored == count && stored < LINE_MAX_TOKENS) items[stored++] = token;
+        count++;
+    }
+
+    /// Remove the first token. Tokens that didn't fit stay missing, so overflowed() keeps telling.
+    void pop_front () {
+        for (size_t i = 1; i < stored; i++) items[i - 1] = items[i];
+        if (stored > 0) stored--;
+        if (count > 0) count--;
+    }
+
+    /// Whether some tokens of the line weren't stored
+    bool overflowed () const { return stored < count; }
+
+    size_t size () const { return count; }
+    bool empty () const { return count == 0; }
+
+    const string_view& operator[] (size_t index) const {
+        return items[index];
+    }
+
+    /// The 1-based column of a stored token, or 0 if it is unknown
+    int column (size_t index) const {
+        if (line_start == nullptr || index >= stored) return 0;
+        return (int)(items[index].data() - line_start) + 1;
+    }
+};
@@ -0,0 +1,133 @@
+#pragma once
+#include "../shared.hpp"
+#include "object_file.hpp"
+#include "symbol_table.hpp"
+#include "../thread_pool.hpp"
+
+/// Places object files one after another in a single image and patches their relocations.
+/// A label defined in a module always resolves within it. A label a module uses without defining it
+/// resolves to the one module that defines it, and is an error if no module or more than one does.
+class linker {
+    public:
+        unsigned int threads = 1;
+
+        /// Problems found while adding or linking, prefixed with the object they concern
+        vector<string> errors = vector<string>();
+
+        /// Statistics of the last link() call
+        size_t relocations_applied = 0;
+
+        explicit linker (unsigned int threads = 1) : threads(std::max(1u, threads)) {}
+
+        /// Add an object held in memory, which must stay valid until the image is linked
+        bool add (const string& name, string_view data) {
+            object_file::object_module module = object_file::object_module();
+            string problem = object_file::decode(data, module);
+            if (!problem.empty()) {
+                errors.push_back(name + ": " + problem);
+                return false;
+            }
+
+            names.push_back(name);
+            modules.push_back(std::move(module));
+            return true;
+        }
+
+        /// Link every added object into the image, in the order they were added
+        bool link (vector<byte>& image) {
+            relocations_applied = 0;
+            vector<size_t> bases = vector<size_t>(modules.size() + 1, 0);
+            for (size_t i = 0; i < modules.size(); i++) bases[i + 1] = bases[i] + modules[i].image_size;
+
+            collect_exports(bases);
+            vector<vector<uint32_t>> values = vector<vector<uint32_t>>(modules.size());
+            for (size_t i = 0; i < modules.size(); i++) resolve_module(i, bases[i], values[i]);
+            if (!errors.empty()) return false;
+
+            // Each group of modules is copied and patched on its own thread, since modules never overlap
+            image.resize(bases.back());
+            size_t groups = std::min<size_t>(threads, modules.size());
+            vector<vector<string>> group_errors = vector<vector<string>>(groups);
+            vector<size_t> group_relocations = vector<size_t>(groups, 0);
+            run_chunks(groups, [&](size_t group) {
+                for (size_t i = group * modules.size() / groups; i < (group + 1) * modules.size() / groups; i++) {
+                    group_relocations[group] += place_module(i, image.data() + bases[i], values[i], group_errors[group]);
+                }
+            });
+
+            for (size_t i = 0; i < groups; i++) {
+                relocations_applied += group_relocations[i];
+                errors.insert(errors.end(), group_errors[i].begin(), group_errors[i].end());
+            }
+            return errors.empty();
+        }
+
+    protected:
+        vector<string> names = vector<string>();
+        vector<object_file::object_module> modules = vector<object_file::object_module>();
+
+        /// Every label defined by any module, with its address and the defining module (SIZE_MAX if there are several)
+        symbol_table exports = symbol_table();
+        vector<size_t> export_modules = vector<size_t>();
+        vector<uint32_t> export_values = vector<uint32_t>();
+
+        void collect_exports (const vector<size_t>& bases) {
+            for (size_t i = 0; i < modules.size(); i++) {
+                for (const object_file::object_symbol& entry : modules[i].symbols) {
+                    if (!entry.defined) continue;
+
+                    size_t index = exports.find_or_add(modules[i].name(entry));
+                    if (index == export_modules.size()) {
+                        export_modules.push_back(i);
+                        export_values.push_back((uint32_t)(bases[i] + entry.value));
+                    } else {
+                        export_modules[index] = SIZE_MAX;
+                    }
+                }
+            }
+        }
+
+        /// Find the address of every symbol a module uses
+        void resolve_module (size_t module_index, size_t base, vector<uint32_t>& values) {
+            const object_file::object_module& module = modules[module_index];
+            values.resize(module.symbols.size());
+
+            for (size_t i = 0; i < module.symbols.size(); i++) {
+                const object_file::object_symbol& entry = module.symbols[i];
+                if (entry.defined) {
+                    values[i] = (uint32_t)(base + entry.value);
+                    continue;
+                }
+
+                string_view name = module.name(entry);
+                size_t index = exports.find(name);
+                if (index == SIZE_MAX) {
+                    errors.push_back(names[module_index] + ": Undefined label '" + string(name) + "'");
+                } else if (export_modules[index] == SIZE_MAX) {
+                    errors.push_back(names[module_index] + ": Label '" + string(name) + "' is defined in more than one object");
+                } else {
+                    values[i] = export_values[index];
+                }
+            }
+        }
+
+        /// Copy a module into the image at its base and patch its relocations, returning how many were applied
+        size_t place_module (size_t module_index, byte* target, const vector<uint32_t>& values, vector<string>& problems) const {
+            const object_file::object_module& module = modules[module_index];
+            if (module.image_size > 0) memcpy(target, module.image, module.image_size);
+
+            size_t applied = 0;
+            for (const object_file::object_relocation& relocation : module.relocations) {
+                uint32_t value = values[relocation.symbol];
+                if (value > 0xFFFF) {
+                    problems.push_back(names[module_index] + ": Label '" + string(module.name(module.symbols[relocation.symbol])) + "' is out of the 16-bit address range");
+                    continue;
+                }
+
+                target[relocation.offset] = (byte)(value >> 8);
+                target[relocation.offset + 1] = (byte)(value & 0xFF);
+                applied++;
+            }
+            return applied;
+        }
+};
@@ -0,0 +1,89 @@
+#pragma once
+#include "../shared.hpp"
+
+/// The number of bits used to index a mnemonic_table
+#define MNEMONIC_HASH_BITS 6
+
+/// The number of slots in a mnemonic_table
+#define MNEMONIC_TABLE_SIZE (1 << MNEMONIC_HASH_BITS)
+
+/// Pack a mnemonic of up to 8 characters into an integer.
+/// Longer (or empty) names pack to 0, which never matches a table entry.
+constexpr uint64_t pack_mnemonic (string_view name) {
+    if (name.empty() || name.size() > sizeof(uint64_t)) return 0;
+
+    uint64_t key = 0;
+    for (size_t i = 0; i < name.size(); i++) {
+        key |= (uint64_t)(byte)name[i] << (8 * i);
+    }
+    return key;
+}
+
+/// A perfect hash table from names to entries of a constant table, built at compile time.
+/// Entries are looked up by their `mnemonic` member; every lookup is one multiply, one shift and one compare.
+/// A constexpr table lives in read-only data and is never written, so any number of threads can use it without locking.
+template <typename T>
+class mnemonic_table {
+    public:
+        struct slot {
+            uint64_t key = 0;
+            const T* entry = nullptr;
+        };
+
+    protected:
+        array<slot, MNEMONIC_TABLE_SIZE> slots = array<slot, MNEMONIC_TABLE_SIZE>();
+        uint64_t multiplier = 0;
+
+        static constexpr size_t hash (uint64_t key, uint64_t multiplier) {
+            return (size_t)((key * multiplier) >> (64 - MNEMONIC_HASH_BITS));
+        }
+
+        /// Step a splitmix64 generator, used to pick multiplier candidates
+        static constexpr uint64_t next_candidate (uint64_t& state) {
+            uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            return (z ^ (z >> 31)) | 1;
+        }
+
+    public:
+        /// Search for a multiplier that maps every entry to its own slot.
+        /// If none is found (or an entry is invalid or duplicated), valid() returns false.
+        template <size_t N>
+        constexpr explicit mnemonic_table (const array<T, N>& entries) {
+            static_assert(N <= MNEMONIC_TABLE_SIZE, "Too many mnemonics for the table size");
+
+            uint64_t state = 0;
+            for (int attempt = 0; attempt < (1 << 16); attempt++) {
+                uint64_t candidate = next_candidate(state);
+
+                uint64_t used = 0; bool perfect = true;
+                for (size_t i = 0; i < N && perfect; i++) {
+                    uint64_t key = pack_mnemonic(entries[i].mnemonic);
+                    uint64_t bit = (uint64_t)1 << hash(key, candidate);
+                    perfect = (key != 0) && !(used & bit);
+                    used |= bit;
+                }
+
+                if (perfect) {
+                    multiplier = candidate;
+                    for (size_t i = 0; i < N; i++) {
+                        uint64_t key = pack_mnemonic(entries[i].mnemonic);
+                        slots[hash(key, multiplier)] = slot { key, &entries[i] };
+                    }
+                    return;
+                }
+            }
+        }
+
+        constexpr bool valid () const {
+            return multiplier != 0;
+        }
+
+        /// Find the entry for a name, or nullptr if there is none
+        constexpr const T* find (string_view name) const {
+            uint64_t key = pack_mnemonic(name);
+            const slot& found = slots[hash(key, multiplier)];
+            return (key != 0 && found.key == key) ? found.entry : nullptr;
+        }
+};
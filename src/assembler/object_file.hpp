@@ -0,0 +1,133 @@
+#pragma once
+#include <cstring>
+#include "../shared.hpp"
+#include "tokenizer_result.hpp"
+#include "emitter.hpp"
+#include "binary_io.hpp"
+
+/// Identifies an object file, followed by the format version
+#define OBJECT_MAGIC "KODAOBJ"
+#define OBJECT_VERSION 1
+
+/// A module assembled with -c, to be placed and patched by koda_ld.
+/// The file holds a header, the image, the symbol table, the relocations and the symbol names, all little-endian:
+///   magic, version, image size, symbol count, relocation count, name bytes   (uint32 each after the magic)
+///   image                                                                   (image size bytes)
+///   symbols      { name offset, name length, value, defined }               (uint32 each)
+///   relocations  { image offset, symbol index }                             (uint32 each)
+///   names
+/// Symbol values are offsets into the module's image, operands referring to defined symbols already hold them.
+namespace object_file {
+
+    struct object_symbol {
+        uint32_t name_offset = 0;
+        uint32_t name_length = 0;
+        uint32_t value = 0;
+        uint32_t defined = 0;
+    };
+
+    /// A 16-bit big-endian operand that holds the address of a symbol
+    struct object_relocation {
+        uint32_t offset = 0;
+        uint32_t symbol = 0;
+    };
+
+    /// A parsed object file. The image and names are views into the loaded data.
+    struct object_module {
+        const byte* image = nullptr;
+        size_t image_size = 0;
+        vector<object_symbol> symbols = vector<object_symbol>();
+        vector<object_relocation> relocations = vector<object_relocation>();
+        string_view names;
+
+        string_view name (const object_symbol& entry) const {
+            return names.substr(entry.name_offset, entry.name_length);
+        }
+    };
+
+    using binary_io::write_value;
+    using binary_io::read_value;
+
+    /// Encode a relocatable result, which must have been resolved with relocatable set
+    vector<byte> encode (const tokenizer_result& result) {
+        vector<byte> output = vector<byte>();
+        string names;
+
+        output.insert(output.end(), OBJECT_MAGIC, OBJECT_MAGIC + strlen(OBJECT_MAGIC));
+        write_value<uint32_t>(output, OBJECT_VERSION);
+        write_value<uint32_t>(output, (uint32_t)result.image.size());
+        write_value<uint32_t>(output, (uint32_t)result.symbols.size());
+        write_value<uint32_t>(output, (uint32_t)result.references.size());
+        size_t names_size = output.size();
+        write_value<uint32_t>(output, 0);
+
+        output.insert(output.end(), result.image.begin(), result.image.end());
+
+        for (size_t i = 0; i < result.symbols.size(); i++) {
+            const symbol& entry = result.symbols[i];
+            string_view name = result.symbols.name(entry);
+            write_value<uint32_t>(output, (uint32_t)names.size());
+            write_value<uint32_t>(output, (uint32_t)name.size());
+            write_value<uint32_t>(output, entry.value);
+            write_value<uint32_t>(output, entry.defined() ? 1 : 0);
+            names += name;
+        }
+
+        for (const symbol_reference& reference : result.references) {
+            write_value<uint32_t>(output, (uint32_t)reference.offset);
+            write_value<uint32_t>(output, (uint32_t)reference.symbol);
+        }
+
+        output.insert(output.end(), names.begin(), names.end());
+        uint32_t size = (uint32_t)names.size();
+        memcpy(&output[names_size], &size, sizeof(uint32_t));
+        return output;
+    }
+
+    /// Write a relocatable result to an object file
+    bool write (const string& target, const tokenizer_result& result) {
+        vector<byte> output = encode(result);
+        return emitter::write_image(target, output.data(), output.size());
+    }
+
+    /// Parse an object file, checking that every symbol and relocation stays inside it.
+    /// Returns an empty string on success, and what is wrong with the file otherwise.
+    string decode (string_view data, object_module& module) {
+        if (data.substr(0, strlen(OBJECT_MAGIC)) != OBJECT_MAGIC) return "not an object file";
+        data.remove_prefix(strlen(OBJECT_MAGIC));
+
+        uint32_t version, image_size, symbol_count, relocation_count, names_size;
+        if (!read_value(data, &version)) return "truncated header";
+        if (version != OBJECT_VERSION) return "unsupported version " + str(version);
+        if (!read_value(data, &image_size) || !read_value(data, &symbol_count) || !read_value(data, &relocation_count) || !read_value(data, &names_size)) {
+            return "truncated header";
+        }
+
+        size_t needed = (size_t)image_size + (size_t)symbol_count * 16 + (size_t)relocation_count * 8 + names_size;
+        if (data.size() < needed) return "truncated file";
+        if (image_size % INSTR_FULL_SIZE != 0) return "image isn't made of whole records";
+
+        module.image = (const byte*)data.data();
+        module.image_size = image_size;
+        data.remove_prefix(image_size);
+
+        module.symbols.resize(symbol_count);
+        for (object_symbol& entry : module.symbols) {
+            read_value(data, &entry.name_offset);
+            read_value(data, &entry.name_length);
+            read_value(data, &entry.value);
+            read_value(data, &entry.defined);
+            if ((size_t)entry.name_offset + entry.name_length > names_size) return "symbol name out of range";
+        }
+
+        module.relocations.resize(relocation_count);
+        for (object_relocation& entry : module.relocations) {
+            read_value(data, &entry.offset);
+            read_value(data, &entry.symbol);
+            if ((size_t)entry.offset + 2 > image_size || entry.symbol >= symbol_count) return "relocation out of range";
+        }
+
+        module.names = data.substr(0, names_size);
+        return "";
+    }
+}
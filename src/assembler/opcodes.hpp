@@ -0,0 +1,131 @@
+#pragma once
+#include "../shared.hpp"
+#include "bytecode.hpp"
+#include "line_tokens.hpp"
+#include "mnemonic_table.hpp"
+
+namespace instructions {
+
+    /// The kinds of operands an instruction can take
+    enum operand_kind : byte {
+        reg8,       // A register index
+        imm8,       // An 8-bit value
+        addr16,     // A 16-bit address
+        raw8,       // A raw data byte, passed through as-is
+    };
+
+    /// The encoded size of each operand_kind, in bytes
+    constexpr int operand_sizes[] = { 1, 1, 2, 1 };
+
+    /// The display name of each operand_kind
+    constexpr string_view operand_names[] = { "reg", "imm8", "addr16", "byte" };
+
+    /// Describes the encoding of one instruction.
+    /// Operands are stored in order, big-endian, starting at the first data byte.
+    struct opcode_spec {
+        string_view mnemonic;
+        ushort code = 0;
+        byte operand_count = 0;
+        array<operand_kind, INSTR_DATA_SIZE> operands = array<operand_kind, INSTR_DATA_SIZE>();
+        string_view description;
+
+        /// The number of data bytes used by the operands
+        constexpr int data_size () const {
+            int size = 0;
+            for (int i = 0; i < operand_count; i++) size += operand_sizes[operands[i]];
+            return size;
+        }
+    };
+
+    /// Every instruction known to the assembler
+    constexpr array<opcode_spec, 24> opcode_table = {{
+        { "noop",  0x0000, 0, {}, "No operation" },
+        { "halt",  0x0001, 0, {}, "Halt" },
+        { "panic", 0x0002, 0, {}, "Panic" },
+
+        { "regi",  0x0100, 1, { reg8 }, "Increment register" },
+        { "regd",  0x0101, 1, { reg8 }, "Decrement register" },
+        { "load",  0x0102, 2, { reg8, imm8 }, "Store value into register" },
+        { "memr",  0x0103, 2, { reg8, addr16 }, "Memory to register" },
+        { "memw",  0x0104, 2, { reg8, addr16 }, "Register to memory" },
+
+        { "staw",  0x0110, 1, { reg8 }, "Write state register" },
+        { "star",  0x0111, 1, { reg8 }, "Read state register" },
+
+        { "jump",  0x0200, 1, { addr16 }, "Jump" },
+        { "jcmp",  0x0201, 2, { reg8, addr16 }, "Jump compare" },
+        { "cmpb",  0x0300, 2, { reg8, reg8 }, "Compare" },
+        { "cmps",  0x0301, 4, { reg8, reg8, reg8, reg8 }, "Compare (16-bit)" },
+
+        { "add",   0x0310, 3, { reg8, reg8, reg8 }, "Add A and B into out" },
+        { "sub",   0x0311, 3, { reg8, reg8, reg8 }, "Subtract B from A into out" },
+        { "and",   0x0312, 3, { reg8, reg8, reg8 }, "Bitwise and of A and B into out" },
+        { "or",    0x0313, 3, { reg8, reg8, reg8 }, "Bitwise or of A and B into out" },
+        { "not",   0x0314, 2, { reg8, reg8 }, "Bitwise not of A into out" },
+        { "xor",   0x0315, 3, { reg8, reg8, reg8 }, "Bitwise xor of A and B into out" },
+
+        { "shl",   0x0316, 3, { reg8, reg8, reg8 }, "Shift A left by B into out" },
+        { "shr",   0x0317, 3, { reg8, reg8, reg8 }, "Shift A right by B into out" },
+
+        { "plat",  0x1000, 2, { reg8, reg8 }, "Platform info into out" },
+        { "ext",   0x1001, 6, { raw8, raw8, raw8, raw8, raw8, raw8 }, "Invoke extension" },
+    }};
+
+    /// Check that every entry fits into an instruction and a line
+    constexpr bool opcode_table_valid () {
+        for (const opcode_spec& spec : opcode_table) {
+            if (spec.data_size() > INSTR_DATA_SIZE) return false;
+            if (spec.operand_count + 1 > LINE_MAX_TOKENS) return false;
+        }
+        return true;
+    }
+    static_assert(opcode_table_valid(), "Invalid opcode table entry");
+
+    /// Check that opcode_table is sorted by code, so find_opcode can search it
+    constexpr bool opcode_table_sorted () {
+        for (size_t i = 1; i < opcode_table.size(); i++) {
+            if (opcode_table[i - 1].code >= opcode_table[i].code) return false;
+        }
+        return true;
+    }
+    static_assert(opcode_table_sorted(), "The opcode table must be sorted by code");
+
+    /// Find the entry for an opcode, or nullptr if there is none
+    constexpr const opcode_spec* find_opcode (ushort code) {
+        size_t low = 0, high = opcode_table.size();
+        while (low < high) {
+            size_t middle = (low + high) / 2;
+            if (opcode_table[middle].code < code) low = middle + 1;
+            else high = middle;
+        }
+        return (low < opcode_table.size() && opcode_table[low].code == code) ? &opcode_table[low] : nullptr;
+    }
+
+    /// Lookup table for opcode_table, by mnemonic
+    constexpr mnemonic_table<opcode_spec> instruction_table = mnemonic_table<opcode_spec>(opcode_table);
+    static_assert(instruction_table.valid(), "No perfect hash found for the opcode table");
+
+    /// Check that every entry is found again by its mnemonic and by its code
+    constexpr bool opcode_lookup_valid () {
+        for (const opcode_spec& spec : opcode_table) {
+            if (instruction_table.find(spec.mnemonic) != &spec) return false;
+            if (find_opcode(spec.code) != &spec) return false;
+        }
+        return instruction_table.find("") == nullptr && instruction_table.find("nop") == nullptr;
+    }
+    static_assert(opcode_lookup_valid(), "The opcode lookup tables don't match the opcode table");
+
+    /// Write a Markdown reference of the instruction set
+    inline void print_reference (ostream& stream) {
+        stream << "| Instruction | Opcode | Operands | Description |\n";
+        stream << "|-------------|--------|----------|-------------|\n";
+
+        for (const opcode_spec& spec : opcode_table) {
+            stream << "| `" << spec.mnemonic << "` | `0x" << std::hex << full_length(ushort) << spec.code << std::dec << std::setfill(' ') << "` | ";
+            for (int i = 0; i < spec.operand_count; i++) {
+                stream << (i > 0 ? " " : "") << operand_names[spec.operands[i]];
+            }
+            stream << " | " << spec.description << " |\n";
+        }
+    }
+}
@@ -0,0 +1,236 @@
+#pragma once
+#include <cstring>
+#include "../shared.hpp"
+#include "opcodes.hpp"
+#include "tokenizer_result.hpp"
+
+namespace optimizer {
+
+    /// The largest number of records a rule looks at
+    constexpr int MAX_WINDOW = 2;
+
+    /// A peephole rule: when the last `window` records have the opcodes in `pattern`, `apply` may rewrite them in place.
+    /// apply returns how many records are left of the window, or -1 if the operands don't match.
+    /// The records that are left are always the first ones of the window, so they keep their place.
+    struct peephole_rule {
+        string_view name;
+        string_view description;
+        int window = 0;
+        array<ushort, MAX_WINDOW> pattern = array<ushort, MAX_WINDOW>();
+        int (*apply)(byte* records) = nullptr;
+    };
+
+    inline ushort record_code (const byte* record) {
+        return (ushort)((record[0] << 8) | record[1]);
+    }
+
+    inline bool same_record (const byte* a, const byte* b) {
+        return memcmp(a, b, INSTR_FULL_SIZE) == 0;
+    }
+
+    /// Opcodes used by the rules below
+    constexpr ushort NOOP = 0x0000, REGI = 0x0100, REGD = 0x0101, LOAD = 0x0102, MEMR = 0x0103, MEMW = 0x0104;
+    constexpr ushort JUMP = 0x0200, JCMP = 0x0201;
+
+    /// Every rule, tried in order on the end of the output after each record
+    constexpr array<peephole_rule, 6> rules = {{
+        { "noop", "Remove noop padding", 1, { NOOP },
+            [](byte*) { return 0; } },
+
+        // memw r A; memr r A -- the register still holds the value just written
+        { "store-load", "Remove a read of the address just written from the same register", 2, { MEMW, MEMR },
+            [](byte* records) { return memcmp(records + INSTR_ADDR_SIZE, records + INSTR_FULL_SIZE + INSTR_ADDR_SIZE, 3) == 0 ? 1 : -1; } },
+
+        // load r v; load r v
+        { "duplicate-load", "Remove a load of the value already in the register", 2, { LOAD, LOAD },
+            [](byte* records) { return same_record(records, records + INSTR_FULL_SIZE) ? 1 : -1; } },
+
+        // load r a; load r b -- the first value is never used
+        { "overwritten-load", "Remove a load that is overwritten right away", 2, { LOAD, LOAD },
+            [](byte* records) {
+                if (records[INSTR_ADDR_SIZE] != records[INSTR_FULL_SIZE + INSTR_ADDR_SIZE]) return -1;
+                records[INSTR_ADDR_SIZE + 1] = records[INSTR_FULL_SIZE + INSTR_ADDR_SIZE + 1];
+                return 1;
+            } },
+
+        // load r v; regi r -> load r v+1, as long as the value doesn't wrap
+        { "fold-increment", "Fold an increment into the load before it", 2, { LOAD, REGI },
+            [](byte* records) {
+                byte* value = records + INSTR_ADDR_SIZE + 1;
+                if (records[INSTR_ADDR_SIZE] != records[INSTR_FULL_SIZE + INSTR_ADDR_SIZE] || *value == 0xFF) return -1;
+                (*value)++;
+                return 1;
+            } },
+
+        // load r v; regd r -> load r v-1
+        { "fold-decrement", "Fold a decrement into the load before it", 2, { LOAD, REGD },
+            [](byte* records) {
+                byte* value = records + INSTR_ADDR_SIZE + 1;
+                if (records[INSTR_ADDR_SIZE] != records[INSTR_FULL_SIZE + INSTR_ADDR_SIZE] || *value == 0x00) return -1;
+                (*value)--;
+                return 1;
+            } },
+    }};
+
+    /// The number of instructions removed by each rule
+    struct optimize_report {
+        array<long long, rules.size()> removed = array<long long, rules.size()>();
+
+        long long total () const {
+            long long sum = 0;
+            for (long long count : removed) sum += count;
+            return sum;
+        }
+
+        void add (const optimize_report& other) {
+            for (size_t i = 0; i < removed.size(); i++) removed[i] += other.removed[i];
+        }
+
+        /// The rules that removed anything, as "name count" separated by commas
+        string summary () const {
+            string text;
+            for (size_t i = 0; i < rules.size(); i++) {
+                if (removed[i] == 0) continue;
+                if (!text.empty()) text += ", ";
+                text += string(rules[i].name) + " " + str(removed[i]);
+            }
+            return text;
+        }
+    };
+
+    /// The byte offset of the address operand of a jump, or 0 if the record isn't one
+    inline int jump_operand (const byte* record) {
+        switch (record_code(record)) {
+            case JUMP: return INSTR_ADDR_SIZE;
+            case JCMP: return INSTR_ADDR_SIZE + 1;
+            default: return 0;
+        }
+    }
+
+    /// Flags of a record while optimizing
+    constexpr byte JUMP_TARGET = 1, DATA_RECORD = 2;
+
+    inline ushort read_address (const byte* operand) {
+        return (ushort)((operand[0] << 8) | operand[1]);
+    }
+
+    inline void write_address (byte* operand, size_t value) {
+        operand[0] = (byte)(value >> 8);
+        operand[1] = (byte)(value & 0xFF);
+    }
+
+    /// Apply the rules to the resolved image of a result, compacting it in place.
+    /// Jump targets are remapped to where their instruction ends up, and a rule never looks past the start of a jump target,
+    /// so code reached by a jump runs the same as before. Targets that don't point at a record are left as they are.
+    /// Data records are never touched. Other label operands are remapped too if the result kept its relocations.
+    inline optimize_report optimize (tokenizer_result& result) {
+        optimize_report report = optimize_report();
+        pmr::vector<byte>& image = result.image;
+        size_t count = image.size() / INSTR_FULL_SIZE;
+
+        vector<byte> flags = vector<byte>(count + 1, 0);
+        for (const data_range& range : result.data) {
+            for (size_t i = range.offset / INSTR_FULL_SIZE; i < (range.offset + range.size) / INSTR_FULL_SIZE; i++) flags[i] |= DATA_RECORD;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            const byte* record = &image[i * INSTR_FULL_SIZE];
+            int operand = jump_operand(record);
+            if (operand == 0 || (flags[i] & DATA_RECORD)) continue;
+
+            size_t target = read_address(record + operand);
+            if (target % INSTR_FULL_SIZE == 0 && target / INSTR_FULL_SIZE <= count) flags[target / INSTR_FULL_SIZE] |= JUMP_TARGET;
+        }
+
+        // new_index[i] is where record i (or whatever replaced it) is in the output, origin[j] is where output record j came from
+        vector<uint> new_index = vector<uint>(count + 1);
+        vector<uint> origin = vector<uint>();
+        vector<byte> output_flags = vector<byte>();
+        origin.reserve(count);
+        output_flags.reserve(count);
+        size_t size = 0;
+        bool carried_target = false;
+
+        for (size_t i = 0; i < count; i++) {
+            if (size != i) memmove(&image[size * INSTR_FULL_SIZE], &image[i * INSTR_FULL_SIZE], INSTR_FULL_SIZE);
+            new_index[i] = (uint)size;
+            origin.push_back((uint)i);
+            output_flags.push_back(flags[i] | (carried_target ? JUMP_TARGET : 0));
+            carried_target = false;
+            size++;
+
+            // Keep rewriting the end of the output until no rule applies
+            bool changed = true;
+            while (changed && size > 0) {
+                changed = false;
+                for (size_t r = 0; r < rules.size() && !changed; r++) {
+                    const peephole_rule& rule = rules[r];
+                    if ((size_t)rule.window > size) continue;
+
+                    size_t first = size - rule.window;
+                    bool matches = true;
+                    for (int w = 0; w < rule.window && matches; w++) {
+                        ushort code = record_code(&image[(first + w) * INSTR_FULL_SIZE]);
+                        matches = (code == rule.pattern[w]) && !(output_flags[first + w] & DATA_RECORD);
+
+                        // Only the first record of a window may be a jump target
+                        if (w > 0 && (output_flags[first + w] & JUMP_TARGET)) matches = false;
+                    }
+                    if (!matches) continue;
+
+                    int left = rule.apply(&image[first * INSTR_FULL_SIZE]);
+                    if (left < 0) continue;
+
+                    // A removed jump target now refers to the record that takes its place
+                    if (left == 0 && (output_flags[first] & JUMP_TARGET)) carried_target = true;
+
+                    report.removed[r] += rule.window - left;
+                    size = first + left;
+                    origin.resize(size);
+                    output_flags.resize(size);
+                    changed = true;
+                }
+            }
+        }
+        new_index[count] = (uint)size;
+
+        for (size_t i = 0; i < size; i++) {
+            byte* record = &image[i * INSTR_FULL_SIZE];
+            int operand = jump_operand(record);
+            if (operand == 0 || (output_flags[i] & DATA_RECORD)) continue;
+
+            size_t target = read_address(record + operand);
+            if (target % INSTR_FULL_SIZE != 0 || target / INSTR_FULL_SIZE > count) continue;
+            write_address(record + operand, (size_t)new_index[target / INSTR_FULL_SIZE] * INSTR_FULL_SIZE);
+        }
+
+        // Labels used anywhere else, such as memr addresses and .word values, move with the record they point to
+        if (result.keep_relocations) {
+            vector<uint> kept = vector<uint>(count, UINT_MAX);
+            for (size_t j = 0; j < size; j++) kept[origin[j]] = (uint)j;
+
+            size_t relocations = 0;
+            for (size_t offset : result.relocations) {
+                size_t moved = kept[offset / INSTR_FULL_SIZE];
+                if (moved == UINT_MAX) continue;
+
+                offset = moved * INSTR_FULL_SIZE + offset % INSTR_FULL_SIZE;
+                result.relocations[relocations++] = offset;
+
+                byte* record = &image[moved * INSTR_FULL_SIZE];
+                bool jump = !(output_flags[moved] & DATA_RECORD) && jump_operand(record) == (int)(offset % INSTR_FULL_SIZE);
+                size_t target = read_address(&image[offset]);
+                if (!jump && target % INSTR_FULL_SIZE == 0 && target / INSTR_FULL_SIZE <= count) {
+                    write_address(&image[offset], (size_t)new_index[target / INSTR_FULL_SIZE] * INSTR_FULL_SIZE);
+                }
+            }
+            result.relocations.resize(relocations);
+        }
+
+        if (result.keep_source_map) result.source_lines.remap(origin);
+        for (data_range& range : result.data) range.offset = (size_t)new_index[range.offset / INSTR_FULL_SIZE] * INSTR_FULL_SIZE;
+
+        image.resize(size * INSTR_FULL_SIZE);
+        return report;
+    }
+}
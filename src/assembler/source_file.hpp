@@ -0,0 +1,98 @@
+#pragma once
+#include "../shared.hpp"
+
+#ifdef _WIN32
+#include <sstream>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/// A read-only view of a whole source file.
+/// On POSIX systems the file is memory-mapped, everywhere else it is read into a single buffer.
+class source_file {
+    protected:
+        const char* mapping = nullptr;
+        size_t length = 0;
+        bool open = false;
+#ifdef _WIN32
+        string buffer;
+#endif
+
+    public:
+        source_file() = default;
+        explicit source_file(const string& filename) {
+            this->open_file(filename);
+        }
+
+        source_file(const source_file&) = delete;
+        source_file& operator= (const source_file&) = delete;
+
+        ~source_file() {
+            this->close();
+        }
+
+        bool open_file (const string& filename) {
+            this->close();
+#ifdef _WIN32
+            ifstream stream (filename, ios::in | ios::binary);
+            if (!stream.is_open()) return false;
+
+            std::stringstream contents;
+            contents << stream.rdbuf();
+            buffer = contents.str();
+
+            mapping = buffer.data();
+            length = buffer.size();
+#else
+            int fd = ::open(filename.c_str(), O_RDONLY);
+            if (fd < 0) return false;
+
+            struct stat info {};
+            if (fstat(fd, &info) != 0) {
+                ::close(fd);
+                return false;
+            }
+
+            length = (size_t)info.st_size;
+            if (length > 0) {
+                void* address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (address == MAP_FAILED) {
+                    ::close(fd);
+                    length = 0;
+                    return false;
+                }
+
+                madvise(address, length, MADV_SEQUENTIAL);
+                mapping = (const char*)address;
+            }
+
+            // The mapping stays valid after the descriptor is closed
+            ::close(fd);
+#endif
+            open = true;
+            return true;
+        }
+
+        void close () {
+#ifdef _WIN32
+            buffer.clear();
+#else
+            if (mapping != nullptr) munmap((void*)mapping, length);
+#endif
+            mapping = nullptr;
+            length = 0;
+            open = false;
+        }
+
+        bool is_open () const {
+            return open;
+        }
+
+        /// The full contents of the file
+        string_view text () const {
+            return string_view(mapping, length);
+        }
+};
@@ -0,0 +1,258 @@
+#pragma once
+#include <cstring>
+#include "../shared.hpp"
+
+/// Identifies a source map file, followed by the format version
+#define SOURCE_MAP_MAGIC "KODAMAP"
+#define SOURCE_MAP_VERSION 1
+
+/// The number of entries between two checkpoints of a source map
+#define SOURCE_MAP_CHECKPOINT 128
+
+/// A decoding start point: the first record of an entry, the line the entry's delta is relative to, and its byte offset
+struct source_map_checkpoint {
+    uint64_t record = 0;
+    uint64_t offset = 0;
+    uint32_t line = 0;
+};
+
+/// Maps record indices to source lines, built while tokenizing.
+/// Consecutive records from one line form an entry, encoded as a varint of (zigzag line delta << 1 | has count),
+/// followed by a varint record count if there is more than one. Code with one instruction per line takes a byte per record.
+/// Every SOURCE_MAP_CHECKPOINT entries a checkpoint is kept, so a lookup is a binary search plus a short decode.
+class source_map {
+    protected:
+        pmr::vector<byte> entries;
+        pmr::vector<source_map_checkpoint> checkpoints;
+        uint64_t records = 0;
+        uint64_t entry_count = 0;
+        uint32_t last_line = 0;
+
+        /// The run of records on one line that isn't encoded yet
+        uint32_t run_line = 0;
+        uint64_t run_count = 0;
+
+        static void write_varint (pmr::vector<byte>& output, uint64_t value) {
+            while (value >= 0x80) {
+                output.push_back((byte)(value | 0x80));
+                value >>= 7;
+            }
+            output.push_back((byte)value);
+        }
+
+        void encode_entry (uint32_t line, uint64_t count) {
+            if (entry_count % SOURCE_MAP_CHECKPOINT == 0) checkpoints.push_back(source_map_checkpoint { records, entries.size(), last_line });
+
+            int64_t delta = (int64_t)line - (int64_t)last_line;
+            uint64_t zigzag = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+            write_varint(entries, (zigzag << 1) | (count > 1 ? 1 : 0));
+            if (count > 1) write_varint(entries, count);
+
+            records += count;
+            entry_count++;
+            last_line = line;
+        }
+
+        /// Add the encoded entries of another map, which has at least one
+        void splice (const source_map& other) {
+            // Only the first entry is relative to the line before it, so it is the only one encoded again
+            const byte* data = other.entries.data();
+            uint32_t first_line = 0; uint64_t first_count = 0;
+            read_entry(data, data + other.entries.size(), first_line, first_count);
+
+            // Starting the count over places a checkpoint on the first entry, in place of the other map's first one
+            uint64_t base = records, kept_entries = entry_count;
+            entry_count = 0;
+            encode_entry(first_line, first_count);
+            entry_count = kept_entries + other.entry_count;
+
+            int64_t shift = (int64_t)entries.size() - (int64_t)(data - other.entries.data());
+            entries.insert(entries.end(), data, other.entries.data() + other.entries.size());
+            for (size_t i = 1; i < other.checkpoints.size(); i++) {
+                source_map_checkpoint point = other.checkpoints[i];
+                checkpoints.push_back(source_map_checkpoint { base + point.record, (uint64_t)((int64_t)point.offset + shift), point.line });
+            }
+
+            records = base + other.records;
+            last_line = other.last_line;
+        }
+
+    public:
+        explicit source_map (pmr::memory_resource* memory = pmr::get_default_resource()) : entries(memory), checkpoints(memory) {}
+
+        /// Read one entry, returning false if the data ends early
+        static bool read_entry (const byte*& data, const byte* end, uint32_t& line, uint64_t& count) {
+            uint64_t values[2] = { 0, 1 };
+            for (int v = 0; v < 2; v++) {
+                uint64_t value = 0;
+                for (int shift = 0; ; shift += 7) {
+                    if (data == end || shift > 63) return false;
+                    byte part = *data++;
+                    value |= (uint64_t)(part & 0x7F) << shift;
+                    if (!(part & 0x80)) break;
+                }
+                values[v] = value;
+                if (v == 0 && !(value & 1)) break;
+            }
+
+            uint64_t zigzag = values[0] >> 1;
+            line = (uint32_t)((int64_t)line + (int64_t)((zigzag >> 1) ^ (~(zigzag & 1) + 1)));
+            count = values[0] & 1 ? values[1] : 1;
+            return true;
+        }
+
+        /// Map the next count records to a line
+        void add (uint32_t line, uint64_t count = 1) {
+            if (run_count > 0 && line == run_line) {
+                run_count += count;
+                return;
+            }
+
+            if (run_count > 0) encode_entry(run_line, run_count);
+            run_line = line;
+            run_count = count;
+        }
+
+        /// Encode the records added last, which are held back in case more of them come from the same line
+        void flush () {
+            if (run_count > 0) encode_entry(run_line, run_count);
+            run_count = 0;
+        }
+
+        void clear () {
+            entries.clear();
+            checkpoints.clear();
+            records = 0;
+            entry_count = 0;
+            last_line = 0;
+            run_count = 0;
+        }
+
+        uint64_t size () const {
+            return records + run_count;
+        }
+
+        /// Add the records of another map after these ones
+        void append (const source_map& other) {
+            flush();
+            if (other.entry_count > 0) splice(other);
+            if (other.run_count > 0) add(other.run_line, other.run_count);
+        }
+
+        /// Rebuild the map after records were removed or moved, where origin[i] is the old index of new record i
+        void remap (const vector<uint>& origin) {
+            flush();
+            vector<uint32_t> lines = vector<uint32_t>((size_t)records);
+            const byte* data = entries.data();
+            uint32_t line = 0; uint64_t count = 0;
+            for (size_t record = 0; record < lines.size(); ) {
+                read_entry(data, entries.data() + entries.size(), line, count);
+                for (uint64_t i = 0; i < count; i++) lines[record++] = line;
+            }
+
+            clear();
+            for (uint index : origin) add(lines[index]);
+            flush();
+        }
+
+        /// Write the map in its file format: a header, the checkpoints and the entries, all little-endian.
+        /// The source name is kept so lookups can name the file.
+        vector<byte> encode (string_view source_name) {
+            flush();
+            vector<byte> output = vector<byte>();
+            auto write = [&](const void* value, size_t size) {
+                output.insert(output.end(), (const byte*)value, (const byte*)value + size);
+            };
+
+            uint32_t version = SOURCE_MAP_VERSION, name_size = (uint32_t)source_name.size();
+            uint64_t checkpoint_count = checkpoints.size(), entry_bytes = entries.size();
+            write(SOURCE_MAP_MAGIC, strlen(SOURCE_MAP_MAGIC));
+            write(&version, sizeof(version));
+            write(&records, sizeof(records));
+            write(&checkpoint_count, sizeof(checkpoint_count));
+            write(&entry_bytes, sizeof(entry_bytes));
+            write(&name_size, sizeof(name_size));
+            write(source_name.data(), source_name.size());
+
+            for (const source_map_checkpoint& point : checkpoints) {
+                write(&point.record, sizeof(point.record));
+                write(&point.offset, sizeof(point.offset));
+                write(&point.line, sizeof(point.line));
+            }
+            write(entries.data(), entries.size());
+            return output;
+        }
+};
+
+/// Looks up lines in an encoded source map, without decoding more than one checkpoint's worth of entries
+class source_map_reader {
+    protected:
+        static constexpr size_t CHECKPOINT_SIZE = 20;
+
+        const byte* checkpoint_data = nullptr;
+        const byte* entry_data = nullptr;
+        uint64_t checkpoint_count = 0;
+        uint64_t entry_bytes = 0;
+
+        source_map_checkpoint checkpoint (uint64_t index) const {
+            source_map_checkpoint point = source_map_checkpoint();
+            const byte* data = checkpoint_data + index * CHECKPOINT_SIZE;
+            memcpy(&point.record, data, 8);
+            memcpy(&point.offset, data + 8, 8);
+            memcpy(&point.line, data + 16, 4);
+            return point;
+        }
+
+    public:
+        uint64_t records = 0;
+        string_view source_name;
+
+        /// Read the header of a map held in memory, which must stay valid while it is used. Returns false if it isn't a valid map.
+        bool open (string_view data) {
+            if (data.substr(0, strlen(SOURCE_MAP_MAGIC)) != SOURCE_MAP_MAGIC) return false;
+            data.remove_prefix(strlen(SOURCE_MAP_MAGIC));
+
+            uint32_t version = 0, name_size = 0;
+            if (data.size() < 32) return false;
+            memcpy(&version, data.data(), 4);
+            memcpy(&records, data.data() + 4, 8);
+            memcpy(&checkpoint_count, data.data() + 12, 8);
+            memcpy(&entry_bytes, data.data() + 20, 8);
+            memcpy(&name_size, data.data() + 28, 4);
+            data.remove_prefix(32);
+            if (version != SOURCE_MAP_VERSION || data.size() < name_size) return false;
+
+            source_name = data.substr(0, name_size);
+            data.remove_prefix(name_size);
+            if (checkpoint_count > data.size() / CHECKPOINT_SIZE || data.size() - checkpoint_count * CHECKPOINT_SIZE != entry_bytes) return false;
+
+            checkpoint_data = (const byte*)data.data();
+            entry_data = checkpoint_data + checkpoint_count * CHECKPOINT_SIZE;
+            return true;
+        }
+
+        /// The line a record came from, or 0 if the record isn't in the map
+        uint32_t line_of (uint64_t record) const {
+            if (record >= records || checkpoint_count == 0) return 0;
+
+            // The last checkpoint at or before the record
+            uint64_t low = 0, high = checkpoint_count;
+            while (high - low > 1) {
+                uint64_t middle = (low + high) / 2;
+                if (checkpoint(middle).record <= record) low = middle;
+                else high = middle;
+            }
+
+            source_map_checkpoint point = checkpoint(low);
+            if (point.offset > entry_bytes) return 0;
+
+            const byte* data = entry_data + point.offset;
+            const byte* end = entry_data + entry_bytes;
+            uint32_t line = point.line; uint64_t first = point.record, count = 0;
+            while (source_map::read_entry(data, end, line, count)) {
+                if (record < first + count) return line;
+                first += count;
+            }
+            return 0;
+        }
+};
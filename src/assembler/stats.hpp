@@ -0,0 +1,141 @@
+#pragma once
+#include <chrono>
+#include "../shared.hpp"
+#include "optimizer.hpp"
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+/// Set KODA_ASM_STATS to 0 to compile all phase timing out of the assembler
+#ifndef KODA_ASM_STATS
+#define KODA_ASM_STATS 1
+#endif
+
+/// The phases of assembling a file
+enum class assembly_phase {
+    read,       // Opening and mapping the source
+    tokenize,   // Splitting lines, looking up instructions and parsing operands
+    resolve,    // Patching label references
+    optimize,   // Running the peephole optimizer
+    report,     // Formatting and printing diagnostics
+    write,      // Writing the image
+    count
+};
+
+constexpr const char* phase_names[] = { "read", "tokenize", "resolve", "optimize", "report", "write" };
+
+/// Timings and counters of one or more assembled files
+struct assembly_stats {
+    array<double, (size_t)assembly_phase::count> seconds = array<double, (size_t)assembly_phase::count>();
+    double wall_seconds = 0;
+
+    long long files = 0;
+    long long lines = 0;
+    long long comments = 0;
+    long long todos = 0;
+    long long instructions = 0;
+    long long errors = 0;
+    long long bytes_written = 0;
+
+    /// The most memory one job used from its arena, in bytes
+    long long arena_peak = 0;
+
+    /// The instructions removed by each rule of the peephole optimizer
+    optimizer::optimize_report optimized = optimizer::optimize_report();
+
+    void add (const assembly_stats& other) {
+        for (size_t i = 0; i < seconds.size(); i++) seconds[i] += other.seconds[i];
+        files += other.files;
+        lines += other.lines;
+        comments += other.comments;
+        todos += other.todos;
+        instructions += other.instructions;
+        errors += other.errors;
+        bytes_written += other.bytes_written;
+        arena_peak = std::max(arena_peak, other.arena_peak);
+        optimized.add(other.optimized);
+    }
+
+    /// The peak resident set size of the process in KiB, or 0 if unknown
+    static long long peak_rss_kb () {
+#ifndef _WIN32
+        struct rusage usage {};
+        if (getrusage(RUSAGE_SELF, &usage) == 0) return (long long)usage.ru_maxrss;
+#endif
+        return 0;
+    }
+
+    void print (ostream& stream) const {
+        stream << std::fixed << std::setprecision(3);
+        stream << "Statistics:\n";
+        for (size_t i = 0; i < seconds.size(); i++) {
+            stream << "  " << std::left << std::setw(14) << phase_names[i] << std::right << std::setw(12) << (seconds[i] * 1000) << " ms\n";
+        }
+        stream << "  " << std::left << std::setw(14) << "wall" << std::right << std::setw(12) << (wall_seconds * 1000) << " ms\n";
+
+        stream << "  " << std::left << std::setw(14) << "files" << std::right << std::setw(12) << files << "\n";
+        stream << "  " << std::left << std::setw(14) << "lines" << std::right << std::setw(12) << lines << "\n";
+        stream << "  " << std::left << std::setw(14) << "comments" << std::right << std::setw(12) << comments << "\n";
+        stream << "  " << std::left << std::setw(14) << "todos" << std::right << std::setw(12) << todos << "\n";
+        stream << "  " << std::left << std::setw(14) << "instructions" << std::right << std::setw(12) << instructions << "\n";
+        stream << "  " << std::left << std::setw(14) << "errors" << std::right << std::setw(12) << errors << "\n";
+        stream << "  " << std::left << std::setw(14) << "bytes written" << std::right << std::setw(12) << bytes_written << "\n";
+        stream << "  " << std::left << std::setw(14) << "arena peak" << std::right << std::setw(12) << (arena_peak / 1024) << " KiB\n";
+        stream << "  " << std::left << std::setw(14) << "peak rss" << std::right << std::setw(12) << peak_rss_kb() << " KiB\n";
+        for (size_t i = 0; i < optimizer::rules.size(); i++) {
+            if (optimized.removed[i] == 0) continue;
+            stream << "  " << std::left << std::setw(14) << string(optimizer::rules[i].name) << std::right << std::setw(12) << optimized.removed[i] << " removed\n";
+        }
+        stream << std::defaultfloat << flush;
+    }
+
+    void print_json (ostream& stream) const {
+        stream << std::fixed << std::setprecision(6);
+        stream << "{\"phases\":{";
+        for (size_t i = 0; i < seconds.size(); i++) {
+            stream << (i > 0 ? "," : "") << "\"" << phase_names[i] << "\":" << seconds[i];
+        }
+        stream << "},\"wall_seconds\":" << wall_seconds
+               << ",\"files\":" << files
+               << ",\"lines\":" << lines
+               << ",\"comments\":" << comments
+               << ",\"todos\":" << todos
+               << ",\"instructions\":" << instructions
+               << ",\"errors\":" << errors
+               << ",\"bytes_written\":" << bytes_written
+               << ",\"arena_peak_kb\":" << (arena_peak / 1024)
+               << ",\"peak_rss_kb\":" << peak_rss_kb()
+               << ",\"optimizer\":{";
+        for (size_t i = 0; i < optimizer::rules.size(); i++) {
+            stream << (i > 0 ? "," : "") << "\"" << optimizer::rules[i].name << "\":" << optimized.removed[i];
+        }
+        stream << "}}\n";
+        stream << std::defaultfloat << flush;
+    }
+};
+
+/// Adds the time until it goes out of scope to a phase, if stats are being collected
+class phase_timer {
+#if KODA_ASM_STATS
+    protected:
+        assembly_stats* stats;
+        assembly_phase phase;
+        std::chrono::steady_clock::time_point start;
+
+    public:
+        phase_timer (assembly_stats* stats, assembly_phase phase) {
+            this->stats = stats;
+            this->phase = phase;
+            if (stats != nullptr) start = std::chrono::steady_clock::now();
+        }
+
+        ~phase_timer () {
+            if (stats == nullptr) return;
+            stats->seconds[(size_t)phase] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+#else
+    public:
+        phase_timer (assembly_stats*, assembly_phase) {}
+#endif
+};
@@ -0,0 +1,113 @@
+#pragma once
+#include <cstdio>
+#include "../shared.hpp"
+#include "tokenizer.hpp"
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+/// The number of bytes read from the input at a time
+#define STREAM_BLOCK_SIZE (64 * 1024)
+
+/// Assembles a stream block by block, writing each block's records before reading the next one.
+/// Memory use stays bounded by the block size, the symbol table and the references still waiting for a label.
+/// References to labels defined in a later block are patched with a seek at the end, which requires a seekable output.
+class stream_assembler {
+    public:
+        assembly_tokenizer* tokenizer = nullptr;
+
+        /// Statistics of the last assemble() call
+        size_t bytes_written = 0;
+        size_t blocks = 0;
+
+        explicit stream_assembler (assembly_tokenizer* tokenizer) : tokenizer(tokenizer) {}
+
+        /// Assemble everything read from input into output. Returns false if reading or writing failed,
+        /// tokenizer errors are reported in the result as usual.
+        bool assemble (FILE* input, FILE* output, tokenizer_result* result) {
+#ifdef _WIN32
+            _setmode(_fileno(input), _O_BINARY);
+            _setmode(_fileno(output), _O_BINARY);
+#endif
+            bytes_written = 0; blocks = 0;
+            long start = ftell(output);
+
+            // Holds the partial last line of the previous block, followed by the next read
+            string buffer;
+            int line_num = 1;
+            bool ok = true;
+            while (true) {
+                size_t kept = buffer.size();
+                buffer.resize(kept + STREAM_BLOCK_SIZE);
+                size_t count = fread(&buffer[kept], 1, STREAM_BLOCK_SIZE, input);
+                buffer.resize(kept + count);
+
+                bool last = (count == 0);
+                if (last && ferror(input)) ok = false;
+
+                // Only complete lines are tokenized, unless this is the end of the input
+                size_t end = last ? buffer.size() : buffer.rfind('\n', buffer.size() - 1);
+                if (end == string::npos) continue;
+                if (!last) end++;
+
+                {
+                    phase_timer timer = phase_timer(tokenizer->stats, assembly_phase::tokenize);
+                    tokenizer->tokenize_text(string_view(buffer).substr(0, end), line_num, result);
+                    line_num += (int)std::count(buffer.begin(), buffer.begin() + (long)end, '\n');
+                }
+                buffer.erase(0, end);
+                if (last) tokenizer->finish(result);
+
+                if (!flush(output, result)) return false;
+                if (last) break;
+            }
+
+            phase_timer timer = phase_timer(tokenizer->stats, assembly_phase::resolve);
+            return patch_output(output, start, result) && ok;
+        }
+
+    private:
+        /// Patch what can be patched in the image, then write it out and start a new one
+        bool flush (FILE* output, tokenizer_result* result) {
+            result->resolve_defined_symbols();
+            if (result->image.empty()) return true;
+
+            phase_timer timer = phase_timer(tokenizer->stats, assembly_phase::write);
+            size_t size = result->image.size();
+            if (fwrite(result->image.data(), 1, size, output) != size) return false;
+
+            bytes_written += size;
+            blocks++;
+            result->image_base += size;
+            result->image.clear();
+            return true;
+        }
+
+        /// Resolve the references left over once the whole input is read, seeking back to their operands
+        bool patch_output (FILE* output, long start, tokenizer_result* result) {
+            bool seekable = (start >= 0);
+            bool ok = true;
+
+            for (const symbol_reference& reference : result->references) {
+                if (!result->check_reference(reference)) continue;
+
+                const symbol& entry = result->symbols[reference.symbol];
+                if (!seekable) {
+                    string name = string(result->symbols.name(entry));
+                    tokenize_error(reference.line, "Forward reference to label '" + name + "' in an earlier block needs a seekable output", result, diagnostic_code::unseekable_output, reference.column);
+                    continue;
+                }
+
+                byte value[2] = { (byte)(entry.value >> 8), (byte)(entry.value & 0xFF) };
+                if (fseek(output, start + (long)reference.offset, SEEK_SET) != 0 || fwrite(value, 1, 2, output) != 2) ok = false;
+            }
+
+            if (seekable && !result->references.empty()) {
+                ok = (fseek(output, 0, SEEK_END) == 0) && ok;
+            }
+            result->references.clear();
+            return (fflush(output) == 0) && ok;
+        }
+};
@@ -0,0 +1,118 @@
+#pragma once
+#include "../shared.hpp"
+
+/// A named location in the image
+struct symbol {
+    uint64_t hash = 0;
+    uint32_t name_offset = 0;
+    uint32_t name_length = 0;
+
+    /// The image offset (in bytes) the symbol refers to, once defined
+    uint value = 0;
+
+    /// The line the symbol was defined on, or 0 if it is not defined (yet)
+    int line = 0;
+
+    /// The 1-based column of the definition, or 0 if unknown
+    int column = 0;
+
+    bool defined () const { return line != 0; }
+};
+
+/// A flat open-addressing hash table of symbols.
+/// Names are copied into one shared buffer, and symbols keep their index for the lifetime of the table.
+class symbol_table {
+    protected:
+        pmr::vector<char> names;
+        pmr::vector<symbol> symbols;
+
+        /// Symbol index + 1 for every slot, 0 if the slot is empty. The size is always a power of two.
+        pmr::vector<uint32_t> slots;
+
+        static uint64_t hash_name (string_view name) {
+            // FNV-1a
+            uint64_t hash = 0xCBF29CE484222325ull;
+            for (char c : name) {
+                hash ^= (byte)c;
+                hash *= 0x100000001B3ull;
+            }
+            return hash;
+        }
+
+        /// The slot holding the name, or the empty slot where it would be inserted
+        size_t find_slot (string_view name, uint64_t hash) const {
+            size_t mask = slots.size() - 1;
+            for (size_t i = (size_t)hash & mask; ; i = (i + 1) & mask) {
+                uint32_t entry = slots[i];
+                if (entry == 0) return i;
+
+                const symbol& candidate = symbols[entry - 1];
+                if (candidate.hash == hash && this->name(candidate) == name) return i;
+            }
+        }
+
+        void grow () {
+            pmr::vector<uint32_t> old = pmr::vector<uint32_t>(slots.size() * 2, 0, slots.get_allocator());
+            old.swap(slots);
+
+            size_t mask = slots.size() - 1;
+            for (uint32_t entry : old) {
+                if (entry == 0) continue;
+
+                size_t i = (size_t)symbols[entry - 1].hash & mask;
+                while (slots[i] != 0) i = (i + 1) & mask;
+                slots[i] = entry;
+            }
+        }
+
+    public:
+        explicit symbol_table (pmr::memory_resource* memory = pmr::get_default_resource()) : names(memory), symbols(memory), slots(64, 0, memory) {}
+
+        size_t size () const {
+            return symbols.size();
+        }
+
+        symbol& operator[] (size_t index) {
+            return symbols[index];
+        }
+        const symbol& operator[] (size_t index) const {
+            return symbols[index];
+        }
+
+        string_view name (const symbol& entry) const {
+            return string_view(names.data() + entry.name_offset, entry.name_length);
+        }
+
+        /// Remove every symbol, keeping the memory for reuse
+        void clear () {
+            names.clear();
+            symbols.clear();
+            std::fill(slots.begin(), slots.end(), 0);
+        }
+
+        /// Find the index of a symbol, or SIZE_MAX if there is none
+        size_t find (string_view name) const {
+            uint32_t entry = slots[find_slot(name, hash_name(name))];
+            return entry == 0 ? SIZE_MAX : entry - 1;
+        }
+
+        /// Find the index of a symbol, adding an undefined one if there is none
+        size_t find_or_add (string_view name) {
+            uint64_t hash = hash_name(name);
+            size_t slot = find_slot(name, hash);
+            if (slots[slot] != 0) return slots[slot] - 1;
+
+            symbol entry = symbol();
+            entry.hash = hash;
+            entry.name_offset = (uint32_t)names.size();
+            entry.name_length = (uint32_t)name.size();
+            names.insert(names.end(), name.begin(), name.end());
+
+            symbols.push_back(entry);
+            slots[slot] = (uint32_t)symbols.size();
+
+            // Keep the load factor at or below one half
+            if (symbols.size() * 2 > slots.size()) grow();
+            return symbols.size() - 1;
+        }
+};
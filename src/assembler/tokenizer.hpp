@@ -2,130 +2,490 @@
 
 #include <sstream>
 #include <vector>
-#include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include "../shared.hpp"
-#include "instruction_tokenizer.hpp"
-#include "bytecode.hpp"
+#include "tokenizer_result.hpp"
+#include "instructions.hpp"
+#include "source_file.hpp"
+#include "stats.hpp"
+#include "include_cache.hpp"
+#include "line_scanner.hpp"
+#include "../thread_pool.hpp"
 
-class tokenizer_result {
-    public:
-        vector<bytecode_instruction> instructions = vector<bytecode_instruction>();
-        int errors = 0;
-        int todos = 0;
+/// How deeply macros may expand into each other
+#define MACRO_MAX_DEPTH 64
 
-        void add_instruction (bytecode_instruction instruction) {
-            instructions.push_back(instruction);
-        }
-};
+/// The most parameters a macro may take
+#define MACRO_MAX_PARAMS 8
 
-class tokenize_error {
-    public:
-        tokenize_error(int line, const string& message, tokenizer_result* result) {
-            cout << cout_err("Tokenizer error on line " << line << ": " << message) << endl;
-            result->errors++;
-        }
-};
+/// How many lines all macro uses of a source may expand to, since nested macros can grow exponentially.
+/// Lines that use other macros count too, so this bounds the work of an expansion and not just its output.
+#ifndef MACRO_MAX_LINES
+#define MACRO_MAX_LINES (1024 * 1024)
+#endif
 
 class assembly_tokenizer {
+    public:
+        /// Phase timings are added here if set
+        assembly_stats* stats = nullptr;
+
+        /// The path of the source, which relative include paths start from
+        string source_path;
+
+        /// Where include files are taken from, shared by the whole process by default
+        include_cache* includes = &include_cache::shared();
+
+        /// If cleared, .include and .incbin are reported as errors instead of reading files
+        bool file_access = true;
+
     protected:
-        map<string, instruction_tokenizer*> instructions = map<string, instruction_tokenizer*>();
+        struct macro {
+            array<string_view, LINE_MAX_TOKENS> params = array<string_view, LINE_MAX_TOKENS>();
+            size_t param_count = 0;
+            vector<token_line> body = vector<token_line>();
+            int line = 0;
+
+            /// Owns the text of the name, parameters and body, since the source may be gone by the time the macro is used
+            std::deque<string> text = std::deque<string>();
+        };
+
+        unordered_map<string, macro> macros = unordered_map<string, macro>();
+        macro* recording = nullptr;
+        string recording_name;
+        int expansion_depth = 0;
+        size_t expanded_lines = 0;
+
+        /// Set once MACRO_MAX_LINES was reached, after which no macro of the source expands
+        bool expansion_capped = false;
+
+        /// Every file included so far, each of which is only included once
+        unordered_set<string> included = unordered_set<string>();
+
+        /// The files being included, innermost last
+        vector<string> include_stack = vector<string>();
 
     public:
+        /// Tokenize a whole source file.
+        /// With more than one thread, the file is split into chunks that are tokenized concurrently.
+        bool tokenize_file (const source_file& source, tokenizer_result* result = nullptr, unsigned int threads = 1) {
+            return tokenize_source(source.text(), result, threads);
+        }
 
-        void add_instruction_tokenizer (const string& keyword, instruction_tokenizer* tokenizer) {
-            instructions[keyword] = tokenizer;
+        /// Tokenize a whole source held in memory and resolve its labels
+        bool tokenize_source (string_view text, tokenizer_result* result, unsigned int threads = 1) {
+            if (result == nullptr) return false;
+
+            {
+                phase_timer timer = phase_timer(stats, assembly_phase::tokenize);
+
+                // Macros and includes change how later lines are read, so they need the file in order
+                if (threads > 1 && !has_directives(text)) {
+                    tokenize_parallel(text, result, threads);
+                } else {
+                    // Every line holds at most one instruction
+                    result->reserve_instructions((size_t)std::count(text.begin(), text.end(), '\n') + 1);
+                    tokenize_text(text, 1, result);
+                }
+                finish(result);
+            }
+
+            phase_timer timer = phase_timer(stats, assembly_phase::resolve);
+            result->resolve_symbols();
+            return true;
         }
 
-        bool tokenize_file (ifstream& stream, tokenizer_result* result = nullptr) {
-            if (result == nullptr) {
-                tokenize_error(0, "No tokenizer_result pointer specified!", result);
-                return false;
+        /// Forget the macros and includes of the previous source
+        void reset () {
+            macros.clear();
+            recording = nullptr;
+            recording_name.clear();
+            expansion_depth = 0;
+            expanded_lines = 0;
+            expansion_capped = false;
+            included.clear();
+            include_stack.clear();
+        }
+
+        /// Check whether the text may contain macros or includes
+        static bool has_directives (string_view text) {
+            return text.find(".macro") != string_view::npos || text.find(".include") != string_view::npos;
+        }
+
+        /// Report anything left open at the end of the source
+        void finish (tokenizer_result* result) {
+            if (recording != nullptr) {
+                tokenize_error(recording->line, "Missing .endm for macro '" + recording_name + "'", result, diagnostic_code::macro_error);
+                recording = nullptr;
             }
+        }
 
-            string line; int line_num = 1;
-            while (std::getline(stream, line)){
-                /*bool ok = */tokenize_line(line, line_num, result);
+        /// Tokenize every line of the text, numbering lines from first_line
+        void tokenize_text (string_view text, int first_line, tokenizer_result* result) {
+            int line_num = first_line;
+            scanner::scan_lines(text, [&](const line_tokens& parts, string_view comment, bool has_comment) {
+                if (has_comment) {
+                    result->comments++;
+                    parse_comment(comment, line_num, result);
+                }
+
+                /*bool ok = */process_tokens(parts, line_num, result);
                 //if (!ok) return false;
                 line_num++;
+            });
+
+            result->lines += line_num - first_line;
+        }
+
+        /// The smallest chunk worth handing to its own thread, in bytes
+        static constexpr size_t MIN_CHUNK_SIZE = 64 * 1024;
+
+        /// Tokenize the text on several threads.
+        /// Instructions are fixed-size, so each chunk is encoded on its own and the results are concatenated in order.
+        void tokenize_parallel (string_view text, tokenizer_result* result, unsigned int threads) {
+            threads = std::min<size_t>(threads, text.size() / MIN_CHUNK_SIZE + 1);
+
+            // Split at line boundaries
+            vector<string_view> chunks;
+            size_t start = 0;
+            for (unsigned int i = 1; i <= threads && start < text.size(); i++) {
+                size_t end = (i == threads) ? text.size() : std::max(start, text.size() / threads * i);
+                end = text.find('\n', end);
+                end = (end == string_view::npos) ? text.size() : end + 1;
+
+                chunks.push_back(text.substr(start, end - start));
+                start = end;
             }
 
-            return true;
+            // Count the lines of each chunk first, so errors can report the right line number
+            vector<int> first_lines = vector<int>(chunks.size() + 1, 0);
+            run_chunks(chunks.size(), [&](size_t i) {
+                first_lines[i + 1] = (int)std::count(chunks[i].begin(), chunks[i].end(), '\n');
+            });
+
+            first_lines[0] = 1;
+            for (size_t i = 1; i < first_lines.size(); i++) first_lines[i] += first_lines[i - 1];
+
+            vector<tokenizer_result> partial = vector<tokenizer_result>(chunks.size());
+            for (tokenizer_result& part : partial) {
+                part.source_name = result->source_name;
+                part.diagnostic_limit = result->diagnostic_limit;
+                part.keep_source_map = result->keep_source_map;
+            }
+
+            run_chunks(chunks.size(), [&](size_t i) {
+                partial[i].reserve_instructions((size_t)(first_lines[i + 1] - first_lines[i]) + 1);
+                tokenize_text(chunks[i], first_lines[i], &partial[i]);
+            });
+
+            size_t total = 0;
+            for (const tokenizer_result& part : partial) total += part.instruction_count();
+            result->reserve_instructions(total);
+
+            for (const tokenizer_result& part : partial) result->append(part);
         }
 
-        const std::string WHITESPACE = " \n\r\t\f\v";
+        static constexpr string_view WHITESPACE = " \n\r\t\f\v";
 
-        std::string ltrim(const std::string &s)
+        static string_view ltrim(string_view s)
         {
             size_t start = s.find_first_not_of(WHITESPACE);
-            return (start == std::string::npos) ? "" : s.substr(start);
+            return (start == string_view::npos) ? string_view() : s.substr(start);
         }
 
-        std::string rtrim(const std::string &s)
+        static string_view rtrim(string_view s)
         {
             size_t end = s.find_last_not_of(WHITESPACE);
-            return (end == std::string::npos) ? "" : s.substr(0, end + 1);
+            return (end == string_view::npos) ? string_view() : s.substr(0, end + 1);
         }
 
-        std::string trim(const std::string &s) {
+        static string_view trim(string_view s) {
             return rtrim(ltrim(s));
         }
 
-        void parse_comment (vector<string> parts, int line, tokenizer_result* result) {
-            string buffer;
-            for(const string& part : parts) buffer += (" " + part);
-
-            buffer = trim(buffer);
-            if (buffer.find("TODO: ") != std::string::npos) {
-                std::stringstream stream(buffer);
-
-                for (int i = 0; i < 2; i++) {
-                    std::getline(stream, buffer, ':');
+        void parse_comment (string_view comment, int line, tokenizer_result* result) {
+            // A to-do is "TODO:" followed by at least one space and some text
+            size_t position = comment.find("TODO:");
+            while (position != string_view::npos) {
+                string_view rest = comment.substr(position + 5);
+                if (!rest.empty() && rest[0] == ' ' && !trim(rest).empty()) {
+                    //cout << "TO-DO on line " << line << ": \"" << trim(rest) << "\"" << endl;
+                    result->todos++;
+                    return;
                 }
-
-                buffer = trim(buffer);
-                //cout << "TO-DO on line " << line << ": \"" << buffer << "\"" << endl;
-                result->todos++;
+                position = comment.find("TODO:", position + 5);
             }
         }
 
-        bool tokenize_line (const string& line, int line_num, tokenizer_result* result) {
-            std::stringstream stream(line);
+        /// Split a line into tokens, counting its comment
+        void split_line (string_view line, int line_num, line_tokens& parts, tokenizer_result* result) {
+            parts = line_tokens();
+            parts.line_start = line.data();
+
+            scanner::scan_lines(line, [&](const line_tokens& tokens, string_view comment, bool has_comment) {
+                parts = tokens;
+                if (has_comment) {
+                    result->comments++;
+                    parse_comment(comment, line_num, result);
+                }
+            });
+        }
 
-            vector<string> parts;
-            vector<string> comment_parts;
+        bool tokenize_line (string_view line, int line_num, tokenizer_result* result) {
+            line_tokens parts;
+            split_line(line, line_num, parts, result);
+            return process_tokens(parts, line_num, result);
+        }
 
-            string buffer; bool comment = false;
-            while (std::getline(stream, buffer, ' ')) {
-                if (buffer.empty()) continue;
+        /// Handle the tokens of one line: record it into a macro, or define its label and then encode, expand or run it
+        bool process_tokens (line_tokens parts, int line_num, tokenizer_result* result) {
+            if (result->current_file.empty()) result->source_line = line_num;
 
-                if (buffer.rfind(';', 0) == 0) {
-                    buffer = buffer.substr(1);
-                    comment = true;
+            if (recording != nullptr) {
+                if (!parts.empty() && parts[0] == ".endm") {
+                    recording = nullptr;
+                } else if (!parts.empty() && parts[0] == ".macro") {
+                    tokenize_error(line_num, "Macros can't be defined inside macro '" + recording_name + "'", result, diagnostic_code::macro_error, parts.column(0));
+                } else if (!parts.empty()) {
+                    recording->body.push_back(copy_tokens(parts, line_num, recording->text));
                 }
+                return true;
+            }
 
-                if (comment) {
-                    comment_parts.push_back(buffer);
+            // A first token ending in ':' defines a label for the next instruction
+            if (!parts.empty() && parts[0].size() > 1 && parts[0].back() == ':') {
+                string_view label = parts[0].substr(0, parts[0].size() - 1);
+                if (instructions::is_label_name(label)) {
+                    result->define_label(label, line_num, parts.column(0));
                 } else {
-                    parts.push_back(buffer);
+                    tokenize_error(line_num, "Invalid label name '" + string(label) + "'", result, diagnostic_code::invalid_label, parts.column(0));
                 }
-            }
-
-            if (!comment_parts.empty()) {
-                parse_comment(comment_parts, line_num, result);
+                parts.pop_front();
             }
 
             if (!parts.empty()) {
-                string name = parts[0];
-                auto instruction = instructions[name];
+                string_view name = parts[0];
+                if (name[0] == '.') return process_directive(parts, line_num, result);
 
+                const instructions::opcode_spec* instruction = instructions::instruction_table.find(name);
                 if (instruction == nullptr) {
-                    tokenize_error(line_num, "Unknown instruction '" + name + "'", result);
+                    auto definition = macros.empty() ? macros.end() : macros.find(string(name));
+                    if (definition != macros.end()) return expand_macro(definition->second, name, parts, line_num, result);
+
+                    tokenize_error(line_num, "Unknown instruction '" + string(name) + "'", result, diagnostic_code::unknown_instruction, parts.column(0));
                     return false;
                 }
 
-                instruction->tokenize(parts, line_num, result);
+                instructions::encode(*instruction, parts, line_num, result);
             }
 
             return true;
         }
-};
\ No newline at end of file
+
+    protected:
+        bool process_directive (const line_tokens& parts, int line_num, tokenizer_result* result) {
+            if (parts[0] == ".include") return include(parts, line_num, result);
+            if (parts[0] == ".macro") return define_macro(parts, line_num, result);
+
+            if (parts[0] == ".byte") {
+                instructions::encode_values(parts, 1, line_num, result);
+                return true;
+            }
+            if (parts[0] == ".word") {
+                instructions::encode_values(parts, 2, line_num, result);
+                return true;
+            }
+            if (parts[0] == ".fill") {
+                instructions::encode_fill(parts, line_num, result);
+                return true;
+            }
+            if (parts[0] == ".incbin") return include_binary(parts, line_num, result);
+
+            if (parts[0] == ".endm") {
+                tokenize_error(line_num, ".endm without .macro", result, diagnostic_code::macro_error, parts.column(0));
+            } else {
+                tokenize_error(line_num, "Unknown directive '" + string(parts[0]) + "'", result, diagnostic_code::unknown_directive, parts.column(0));
+            }
+            return false;
+        }
+
+        /// Read the quoted file name of an .include or .incbin and resolve it.
+        /// Relative paths start from the directory of the including file.
+        bool file_argument (const line_tokens& parts, int line_num, tokenizer_result* result, string& key) {
+            if (!file_access) {
+                tokenize_error(line_num, string(parts[0]) + " can't read files here", result, diagnostic_code::include_error, parts.column(0));
+                return false;
+            }
+
+            string_view name = (parts.size() == 2) ? parts[1] : string_view();
+            if (name.size() < 3 || name.front() != '"' || name.back() != '"') {
+                tokenize_error(line_num, "Expected " + string(parts[0]) + " \"file\"", result, diagnostic_code::include_error, parts.column(0));
+                return false;
+            }
+            name = name.substr(1, name.size() - 2);
+
+            filesystem::path path = filesystem::path(string(name));
+            if (path.is_relative()) {
+                string from = include_stack.empty() ? source_path : include_stack.back();
+                path = filesystem::path(from).parent_path() / path;
+            }
+            key = path.lexically_normal().string();
+            return true;
+        }
+
+        /// .incbin "file": copy a whole file into the output as data
+        bool include_binary (const line_tokens& parts, int line_num, tokenizer_result* result) {
+            string key;
+            if (!file_argument(parts, line_num, result, key)) return false;
+
+            source_file file = source_file(key);
+            if (!file.is_open()) {
+                tokenize_error(line_num, "Unable to open file '" + key + "'", result, diagnostic_code::include_error, parts.column(1));
+                return false;
+            }
+
+            string_view bytes = file.text();
+            if (!bytes.empty()) memcpy(result->add_data(bytes.size()), bytes.data(), bytes.size());
+            return true;
+        }
+
+        /// .include "file": tokenize a file in place of this line, unless it was included before
+        bool include (const line_tokens& parts, int line_num, tokenizer_result* result) {
+            string key;
+            if (!file_argument(parts, line_num, result, key)) return false;
+
+            if (included.empty() && !source_path.empty()) included.insert(filesystem::path(source_path).lexically_normal().string());
+            if (!included.insert(key).second) return true;
+
+            shared_ptr<const include_file> file = includes->get(key, [this](include_file& entry) {
+                split_include(entry);
+            });
+            if (!file->open) {
+                tokenize_error(line_num, "Unable to open include file '" + key + "'", result, diagnostic_code::include_error, parts.column(1));
+                return false;
+            }
+
+            result->lines += file->line_count;
+            result->comments += file->comments;
+            result->todos += file->todos;
+
+            string_view outer_file = result->current_file;
+            result->current_file = file->path;
+            include_stack.push_back(file->path);
+
+            for (const token_line& entry : file->lines) process_tokens(entry.tokens, entry.line, result);
+
+            include_stack.pop_back();
+            result->current_file = outer_file;
+            return true;
+        }
+
+        /// Split every line of an include file into tokens, keeping the ones that aren't empty
+        void split_include (include_file& file) {
+            tokenizer_result counts = tokenizer_result();
+
+            int line_num = 1;
+            scanner::scan_lines(file.source.text(), [&](const line_tokens& parts, string_view comment, bool has_comment) {
+                if (has_comment) {
+                    counts.comments++;
+                    parse_comment(comment, line_num, &counts);
+                }
+                if (!parts.empty()) file.lines.push_back(token_line { parts, line_num });
+                line_num++;
+            });
+
+            file.line_count = line_num - 1;
+            file.comments = counts.comments;
+            file.todos = counts.todos;
+        }
+
+        /// .macro name [params...]: record the following lines up to .endm
+        bool define_macro (const line_tokens& parts, int line_num, tokenizer_result* result) {
+            if (parts.size() < 2 || parts.size() > MACRO_MAX_PARAMS + 2 || parts.overflowed()) {
+                tokenize_error(line_num, "Expected .macro name followed by up to " + str(MACRO_MAX_PARAMS) + " parameters", result, diagnostic_code::macro_error, parts.column(0));
+                return false;
+            }
+
+            for (size_t i = 1; i < parts.size(); i++) {
+                if (!instructions::is_label_name(parts[i])) {
+                    tokenize_error(line_num, "Invalid macro " + string(i == 1 ? "name" : "parameter") + " '" + string(parts[i]) + "'", result, diagnostic_code::macro_error, parts.column(i));
+                    return false;
+                }
+            }
+
+            string name = string(parts[1]);
+            if (instructions::instruction_table.find(name) != nullptr) {
+                tokenize_error(line_num, "Macro '" + name + "' has the name of an instruction", result, diagnostic_code::macro_error, parts.column(1));
+                return false;
+            }
+
+            auto found = macros.find(name);
+            if (found != macros.end()) {
+                tokenize_error(line_num, "Macro '" + name + "' is already defined on line " + str(found->second.line), result, diagnostic_code::macro_error, parts.column(1));
+                return false;
+            }
+
+            macro& definition = macros[name];
+            definition.line = line_num;
+            for (size_t i = 2; i < parts.size(); i++) {
+                definition.params[definition.param_count++] = definition.text.emplace_back(parts[i]);
+            }
+
+            recording = &definition;
+            recording_name = name;
+            return true;
+        }
+
+        /// Expand a macro in place of this line, replacing its parameters with the arguments
+        bool expand_macro (const macro& definition, string_view name, const line_tokens& parts, int line_num, tokenizer_result* result) {
+            if (parts.size() - 1 != definition.param_count) {
+                tokenize_error(line_num, "Macro '" + string(name) + "' takes " + plural_num_string("argument", (long long)definition.param_count) + ", got " + str(parts.size() - 1), result, diagnostic_code::argument_count, parts.column(0));
+                return false;
+            }
+            if (expansion_depth >= MACRO_MAX_DEPTH) {
+                tokenize_error(line_num, "Macro '" + string(name) + "' expands too deeply", result, diagnostic_code::macro_error, parts.column(0));
+                return false;
+            }
+
+            // Only the first use over the limit is reported, and the rest of the expansion unwinds without walking its tree
+            if (expansion_capped) return false;
+            if (expanded_lines + definition.body.size() > MACRO_MAX_LINES) {
+                expansion_capped = true;
+                tokenize_error(line_num, "Macro '" + string(name) + "' expands to more than " + str(MACRO_MAX_LINES) + " lines", result, diagnostic_code::macro_error, parts.column(0));
+                return false;
+            }
+
+            expanded_lines += definition.body.size();
+            expansion_depth++;
+            for (const token_line& entry : definition.body) {
+                if (expansion_capped) break;
+                line_tokens expanded = line_tokens();
+                for (size_t i = 0; i < entry.tokens.stored; i++) {
+                    string_view token = entry.tokens[i];
+                    for (size_t p = 0; p < definition.param_count; p++) {
+                        if (token == definition.params[p]) {
+                            token = parts[1 + p];
+                            break;
+                        }
+                    }
+                    expanded.push_back(token);
+                }
+                expanded.count = entry.tokens.size();
+
+                // Errors inside the expansion are reported on the line that uses the macro
+                process_tokens(expanded, line_num, result);
+            }
+            expansion_depth--;
+            return true;
+        }
+
+        /// Copy tokens into text owned by the caller, so they outlive the line they were taken from
+        static token_line copy_tokens (const line_tokens& parts, int line_num, std::deque<string>& text) {
+            token_line entry = token_line();
+            entry.line = line_num;
+
+            for (size_t i = 0; i < parts.stored; i++) entry.tokens.push_back(text.emplace_back(parts[i]));
+            entry.tokens.count = parts.size();
+            return entry;
+        }
+};
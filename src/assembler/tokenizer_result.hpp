@@ -0,0 +1,243 @@
+#pragma once
+#include <cstring>
+#include "../shared.hpp"
+#include "bytecode.hpp"
+#include "symbol_table.hpp"
+#include "diagnostics.hpp"
+#include "source_map.hpp"
+
+class tokenizer_result;
+class tokenize_error {
+    public:
+        tokenize_error(int line, const string& message, tokenizer_result* result, diagnostic_code code, int column = 0);
+};
+
+/// A use of a symbol as a 16-bit operand, patched once all symbols are known
+struct symbol_reference {
+    /// The image offset of the operand
+    size_t offset = 0;
+    size_t symbol = 0;
+    int line = 0;
+    int column = 0;
+};
+
+/// A run of records in the output that hold data instead of instructions
+struct data_range {
+    size_t offset = 0;
+    size_t size = 0;
+};
+
+class tokenizer_result {
+    public:
+        /// The encoded instructions, as INSTR_FULL_SIZE byte records ready to be written out
+        pmr::vector<byte> image;
+
+        /// The output offset of the first image byte, non-zero once earlier parts of the image were written out
+        size_t image_base = 0;
+        string source_name;
+
+        /// The include file being tokenized, empty while in the source itself
+        string_view current_file;
+
+        /// Every error is counted, but only about the diagnostic_limit lowest by position are kept, in report order.
+        /// Errors found late (like undefined labels during resolve) still make it in if their lines come first.
+        vector<diagnostic> diagnostics = vector<diagnostic>();
+        size_t diagnostic_limit = SIZE_MAX;
+        int errors = 0;
+        int todos = 0;
+        long long lines = 0;
+        long long comments = 0;
+
+        symbol_table symbols;
+        pmr::vector<symbol_reference> references;
+
+        /// The records written by data directives, in order, with adjacent ranges merged
+        pmr::vector<data_range> data;
+
+        /// If set, the output offset of every operand patched with a label value is kept in relocations
+        bool keep_relocations = false;
+        pmr::vector<size_t> relocations;
+
+        /// If set, the line of every record is kept in source_lines, taken from source_line when the record is added.
+        /// Records from include files get the line of the .include.
+        bool keep_source_map = false;
+        int source_line = 0;
+        source_map source_lines;
+
+        /// If set, the result is linked later: undefined labels aren't errors, and every reference is kept after resolving
+        bool relocatable = false;
+
+        /// The image, symbols and references are allocated from the given memory, such as the arena of an assembly job
+        tokenizer_result (pmr::memory_resource* memory = pmr::get_default_resource()) : image(memory), symbols(memory), references(memory), data(memory), relocations(memory), source_lines(memory) {}
+
+        /// Reset to an empty result, keeping the allocated memory and the settings
+        void clear () {
+            image.clear();
+            image_base = 0;
+            current_file = string_view();
+            diagnostics.clear();
+            errors = 0;
+            todos = 0;
+            lines = 0;
+            comments = 0;
+            symbols.clear();
+            references.clear();
+            data.clear();
+            relocations.clear();
+            source_line = 0;
+            source_lines.clear();
+        }
+
+        /// The size of the output so far, including parts that were already written out
+        size_t output_size () const {
+            return image_base + image.size();
+        }
+
+        size_t instruction_count () const {
+            return output_size() / INSTR_FULL_SIZE;
+        }
+
+        /// Make room for the given number of additional instructions
+        void reserve_instructions (size_t count) {
+            image.reserve(image.size() + count * INSTR_FULL_SIZE);
+        }
+
+        /// Append an instruction with the given opcode and zeroed data, and return a pointer to its data bytes
+        byte* add_instruction (ushort code) {
+            size_t offset = image.size();
+            image.resize(offset + INSTR_FULL_SIZE);
+
+            ushort big_endian = to_big_endian(code);
+            memcpy(&image[offset], &big_endian, INSTR_ADDR_SIZE);
+            if (keep_source_map) source_lines.add((uint32_t)source_line);
+            return &image[offset + INSTR_ADDR_SIZE];
+        }
+
+        /// Append zeroed data, padded to whole records so the next instruction stays aligned, and return a pointer to it
+        byte* add_data (size_t size) {
+            size_t offset = image.size();
+            size_t padded = (size + INSTR_FULL_SIZE - 1) / INSTR_FULL_SIZE * INSTR_FULL_SIZE;
+            if (padded == 0) return image.data() + offset;
+
+            image.resize(offset + padded);
+            add_data_range(data_range { image_base + offset, padded });
+            if (keep_source_map) source_lines.add((uint32_t)source_line, padded / INSTR_FULL_SIZE);
+            return &image[offset];
+        }
+
+        /// Define a label at the given output offset (the end of the output by default)
+        bool define_label (string_view name, int line, int column, size_t offset = SIZE_MAX) {
+            symbol& entry = symbols[symbols.find_or_add(name)];
+            if (entry.defined()) {
+                tokenize_error(line, "Label '" + string(name) + "' is already defined on line " + str(entry.line), this, diagnostic_code::duplicate_label, column);
+                return false;
+            }
+
+            entry.value = (uint)(offset == SIZE_MAX ? output_size() : offset);
+            entry.line = line;
+            entry.column = column;
+            return true;
+        }
+
+        /// Record a 16-bit operand at the given output offset that refers to a symbol
+        void add_reference (string_view name, size_t offset, int line, int column = 0) {
+            references.push_back(symbol_reference { offset, symbols.find_or_add(name), line, column });
+        }
+
+        /// Check that the symbol of a reference is defined and fits its operand, reporting an error if not
+        bool check_reference (const symbol_reference& reference) {
+            const symbol& entry = symbols[reference.symbol];
+            string_view name = symbols.name(entry);
+
+            if (!entry.defined()) {
+                tokenize_error(reference.line, "Undefined label '" + string(name) + "'", this, diagnostic_code::undefined_label, reference.column);
+                return false;
+            }
+            if (entry.value > 0xFFFF) {
+                tokenize_error(reference.line, "Label '" + string(name) + "' is out of the 16-bit address range", this, diagnostic_code::label_range, reference.column);
+                return false;
+            }
+            return true;
+        }
+
+        /// Patch every symbol reference with the value of its symbol
+        void resolve_symbols () {
+            for (const symbol_reference& reference : references) {
+                if (relocatable && !symbols[reference.symbol].defined()) continue;
+                if (check_reference(reference)) patch_reference(reference);
+            }
+            if (!relocatable) references.clear();
+        }
+
+        /// Patch the references that can already be resolved within the image, and keep the others.
+        /// Used before writing out part of the image, when later lines may still define labels.
+        void resolve_defined_symbols () {
+            size_t kept = 0;
+            for (const symbol_reference& reference : references) {
+                if (reference.offset >= image_base && symbols[reference.symbol].defined()) {
+                    if (check_reference(reference)) patch_reference(reference);
+                } else {
+                    references[kept++] = reference;
+                }
+            }
+            references.resize(kept);
+        }
+
+        /// Append the output of another result, as if it was tokenized right after this one
+        void append (const tokenizer_result& other) {
+            size_t base = output_size();
+            image.insert(image.end(), other.image.begin(), other.image.end());
+            for (const data_range& range : other.data) add_data_range(data_range { base + range.offset, range.size });
+            if (keep_source_map) source_lines.append(other.source_lines);
+            errors += other.errors;
+            todos += other.todos;
+            lines += other.lines;
+            comments += other.comments;
+
+            for (const diagnostic& record : other.diagnostics) add_diagnostic(record);
+
+            // Symbols of the other result are relative to its own image
+            vector<size_t> indices = vector<size_t>(other.symbols.size());
+            for (size_t i = 0; i < other.symbols.size(); i++) {
+                const symbol& entry = other.symbols[i];
+                string_view name = other.symbols.name(entry);
+
+                if (entry.defined()) define_label(name, entry.line, entry.column, base + entry.value);
+                indices[i] = symbols.find_or_add(name);
+            }
+
+            for (const symbol_reference& reference : other.references) {
+                references.push_back(symbol_reference { base + reference.offset, indices[reference.symbol], reference.line, reference.column });
+            }
+        }
+
+        /// Keep a diagnostic. Once twice the limit are kept, only the lowest diagnostic_limit of them stay.
+        void add_diagnostic (const diagnostic& record) {
+            diagnostics.push_back(record);
+            if (diagnostics.size() / 2 < diagnostic_limit) return;
+
+            std::nth_element(diagnostics.begin(), diagnostics.begin() + diagnostic_limit, diagnostics.end(), diagnostic_before);
+            diagnostics.resize(diagnostic_limit);
+        }
+
+        /// Mark records already in the image as data
+        void add_data_range (data_range range) {
+            if (!data.empty() && data.back().offset + data.back().size == range.offset) data.back().size += range.size;
+            else data.push_back(range);
+        }
+
+    private:
+
+        /// Write the value of a reference's symbol into its operand bytes, which must still be in the image
+        void patch_reference (const symbol_reference& reference) {
+            uint value = symbols[reference.symbol].value;
+            image[reference.offset - image_base] = (byte)(value >> 8);
+            image[reference.offset - image_base + 1] = (byte)(value & 0xFF);
+            if (keep_relocations) relocations.push_back(reference.offset);
+        }
+};
+
+inline tokenize_error::tokenize_error(int line, const string& message, tokenizer_result* result, diagnostic_code code, int column) {
+    result->errors++;
+    result->add_diagnostic(diagnostic { line, column, code, message, string(result->current_file) });
+}
@@ -0,0 +1,71 @@
+#include "koda_asm.hpp"
+#include "assembler/tokenizer.hpp"
+#include "assembler/optimizer.hpp"
+#include "assembler/arena.hpp"
+
+namespace koda {
+
+    struct workspace::state {
+        /// Everything a call allocates for its result comes from here and is given back at once by the next call
+        arena memory;
+        std::optional<tokenizer_result> result;
+        assembly_tokenizer tokenizer = assembly_tokenizer();
+
+        state () {
+            tokenizer.file_access = false;
+            tokenizer.includes = nullptr;
+        }
+    };
+
+    workspace::workspace () : impl(make_unique<state>()) {}
+    workspace::~workspace () = default;
+    workspace::workspace (workspace&& other) noexcept = default;
+    workspace& workspace::operator= (workspace&& other) noexcept = default;
+
+    /// Tokenize, resolve and optionally optimize a source into the workspace, copying its diagnostics out
+    static tokenizer_result& assemble_image (std::string_view source, diagnostics& found, workspace& space, const options& settings) {
+        workspace::state& state = space.get();
+
+        // The old result lives in the arena, so it goes before the arena is reset and a new one is built in it
+        state.result.reset();
+        state.memory.reset();
+        tokenizer_result& image = state.result.emplace(&state.memory);
+        image.diagnostic_limit = found.limit;
+        image.keep_relocations = settings.optimize;
+
+        state.tokenizer.reset();
+        state.tokenizer.tokenize_source(source, &image);
+        if (settings.optimize && image.errors == 0) optimizer::optimize(image);
+
+        found.clear();
+        found.errors = image.errors;
+        sort_diagnostics(image.diagnostics, found.limit);
+        for (const ::diagnostic& record : image.diagnostics) {
+            found.records.push_back(diagnostic { record.line, record.column, diagnostic_names[(size_t)record.code], record.message });
+        }
+        return image;
+    }
+
+    result assemble (std::string_view source, std::uint8_t* output, std::size_t capacity, diagnostics& found, workspace& space, const options& settings) {
+        const tokenizer_result& image = assemble_image(source, found, space, settings);
+        if (image.errors > 0) return result { status::errors, 0, 0 };
+
+        result outcome = result { status::ok, image.image.size(), image.instruction_count() };
+        if (outcome.size > capacity) {
+            outcome.code = status::output_too_small;
+            return outcome;
+        }
+
+        if (outcome.size > 0) memcpy(output, image.image.data(), outcome.size);
+        return outcome;
+    }
+
+    result assemble (std::string_view source, std::vector<std::uint8_t>& output, diagnostics& found, workspace& space, const options& settings) {
+        const tokenizer_result& image = assemble_image(source, found, space, settings);
+        output.clear();
+        if (image.errors > 0) return result { status::errors, 0, 0 };
+
+        output.assign(image.image.begin(), image.image.end());
+        return result { status::ok, image.image.size(), image.instruction_count() };
+    }
+}
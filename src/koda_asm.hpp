@@ -0,0 +1,83 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// The in-memory assembler API of libkoda_asm.
+/// Calls are reentrant: every call only touches the workspace and buffers passed to it, so threads can assemble
+/// concurrently as long as each one uses its own workspace. Nothing is printed and no files are read or written,
+/// so .include and .incbin are reported as errors.
+namespace koda {
+
+    /// One problem found in the source
+    struct diagnostic {
+        int line = 0;
+
+        /// The 1-based column of the offending token, or 0 if it doesn't apply
+        int column = 0;
+
+        /// A short kebab-case identifier, such as "unknown-instruction"
+        std::string code;
+        std::string message;
+    };
+
+    /// The problems found by one call, sorted by position
+    struct diagnostics {
+        std::vector<diagnostic> records;
+
+        /// Every error is counted, but only the `limit` lowest by position are kept in records
+        int errors = 0;
+        std::size_t limit = 100;
+
+        void clear () {
+            records.clear();
+            errors = 0;
+        }
+    };
+
+    struct options {
+        /// Run the peephole optimizer, like -O
+        bool optimize = false;
+    };
+
+    enum class status {
+        ok,
+        errors,             // The source has errors, nothing was written
+        output_too_small,   // The image didn't fit, size holds the capacity it needs
+    };
+
+    struct result {
+        status code = status::ok;
+
+        /// The size of the image in bytes
+        std::size_t size = 0;
+        std::size_t instructions = 0;
+    };
+
+    /// The memory used while assembling. Keep one per thread and pass it to every call,
+    /// so that after the first few calls assembling doesn't allocate at all.
+    /// The image and symbols of a call are held in an arena, which the next call resets in one step.
+    class workspace {
+        public:
+            struct state;
+
+            workspace ();
+            ~workspace ();
+            workspace (workspace&& other) noexcept;
+            workspace& operator= (workspace&& other) noexcept;
+
+            state& get () { return *impl; }
+
+        private:
+            std::unique_ptr<state> impl;
+    };
+
+    /// Assemble a source into the output buffer, which receives the image if it fits
+    result assemble (std::string_view source, std::uint8_t* output, std::size_t capacity, diagnostics& found, workspace& space, const options& settings = options());
+
+    /// Assemble a source, replacing the contents of the output vector with the image
+    result assemble (std::string_view source, std::vector<std::uint8_t>& output, diagnostics& found, workspace& space, const options& settings = options());
+}
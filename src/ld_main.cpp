@@ -0,0 +1,81 @@
+#include <chrono>
+#include "shared.hpp"
+#include "assembler/source_file.hpp"
+#include "assembler/linker.hpp"
+#include "assembler/emitter.hpp"
+#include "utils.hpp"
+
+/// Link object files written by koda_asm -c into one image.
+/// Returns 0 on success, 1 if the output can't be written, 2 if an object can't be read,
+/// 3 on link errors and 4 if the target exists.
+int main (int argc, char* argv[]) {
+    vector<string> files; string target; unsigned int jobs = 0; bool stats = false;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-o" && i + 1 < argc) {
+            target = argv[++i];
+        } else if ((arg == "-j" || arg == "--jobs") && i + 1 < argc) {
+            jobs = (unsigned int)atoi(argv[++i]);
+        } else if (arg == "--stats") {
+            stats = true;
+        } else {
+            files.push_back(arg);
+        }
+    }
+
+    if (target == "-") cout.rdbuf(cerr.rdbuf());
+    cout << "Koda Linker v1\n--------------------------\n" << endl;
+
+    if (files.empty()) {
+        cout << cout_err("No object file specified.") << endl;
+        return 1;
+    }
+
+    // main.koda.o links to main.koda.bin by default
+    if (target.empty()) {
+        string base = files[0];
+        if (base.size() > 2 && base.compare(base.size() - 2, 2, ".o") == 0) base.resize(base.size() - 2);
+        target = base + ".bin";
+    }
+    if (target != "-" && file_exists(target)) {
+        cout << cout_err("Target file already exists!") << endl;
+        return 4;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    if (jobs == 0) jobs = std::max(1u, std::thread::hardware_concurrency());
+    linker objects = linker(jobs);
+
+    // The objects stay mapped until the image is written
+    vector<unique_ptr<source_file>> mapped;
+    for (const string& file : files) {
+        mapped.push_back(make_unique<source_file>());
+        if (!mapped.back()->open_file(file)) {
+            cout << cout_err("Unable to open " << file << ".") << endl;
+            return 2;
+        }
+        objects.add(file, mapped.back()->text());
+    }
+
+    vector<byte> image = vector<byte>();
+    if (objects.errors.empty()) objects.link(image);
+    if (!objects.errors.empty()) {
+        for (const string& error : objects.errors) cout << cout_err("Linker error: " << error) << "\n";
+        cout << "\nLink failed: " << plural_num_string("error", (long long)objects.errors.size()) << "." << endl;
+        return 3;
+    }
+
+    if (!emitter::write_image(target, image.data(), image.size())) {
+        cout << cout_err("Unable to write output file.") << endl;
+        return 1;
+    }
+
+    cout << "Linked " << plural_num_string("object", (long long)files.size()) << " into " << plural_num_string("instruction", (long long)(image.size() / INSTR_FULL_SIZE))
+         << " with " << plural_num_string("relocation", (long long)objects.relocations_applied) << "." << endl;
+
+    if (stats) {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        cout << std::fixed << std::setprecision(3) << "\nLinked " << image.size() << " bytes in " << (seconds * 1000) << " ms on " << plural_num_string("thread", jobs) << "." << endl;
+    }
+    return 0;
+}
@@ -1,113 +1,511 @@
 #include "shared.hpp"
 #include "assembler/tokenizer.hpp"
 #include "assembler/instructions.hpp"
+#include "assembler/emitter.hpp"
+#include "assembler/assembly_cache.hpp"
+#include "assembler/stream_assembler.hpp"
+#include "assembler/disassembler.hpp"
+#include "assembler/optimizer.hpp"
+#include "assembler/arena.hpp"
+#include "assembler/object_file.hpp"
+#include "thread_pool.hpp"
 
-#define create_and_add_tokenizer(t, i, n) { i tok = i(); t.add_instruction_tokenizer(n, &tok); }
+/// What a run does with its files
+enum class run_mode {
+    assemble,
+    disassemble,
+    verify,
+};
 
-int main (int argc, char* argv[]) {
-    cout << "Koda Assembler v1\n--------------------------\n" << endl;
+/// Options that apply to every file of a run
+struct assembler_options {
+    run_mode mode = run_mode::assemble;
+    string output;
+    unsigned int jobs = 0;
+    bool cache = false;
+    bool optimize = false;
 
-    if (argc >= 2) {
-        string file = argv[1];
-        string target_file = (file + ".bin");
+    /// Write a relocatable object for koda_ld instead of an image
+    bool object = false;
 
-        cout << "Source File: " << file << endl;
-        cout << "Target File: " << target_file << endl;
+    /// Write the source line of every record to <target>.map
+    bool source_map = false;
 
-        if (file_exists(target_file)) {
-            cout << cout_err("Target file already exists!") << endl;
-            return 4;
-        }
+    /// 0 for no statistics, 1 for a readable summary and 2 for JSON
+    int stats = 0;
 
-        cout << "\n";
+    /// The number of errors printed per file, 0 for all of them
+    size_t max_errors = 100;
+};
 
-        ifstream stream = ifstream (file);
-        if (stream.is_open()) {
-            tokenizer_result result = tokenizer_result();
-            assembly_tokenizer tokenizer = assembly_tokenizer();
+/// The outcome of assembling one source file
+struct assembly_report {
+    string file;
+    string target_file;
+    int status = 0;
+    long long instructions = 0;
+    int errors = 0;
 
-            using namespace instructions;
-            create_and_add_tokenizer(tokenizer, base_noop, "noop");
-            create_and_add_tokenizer(tokenizer, base_halt, "halt");
-            create_and_add_tokenizer(tokenizer, base_panic, "panic");
+    /// The instructions removed by each rule with -O
+    optimizer::optimize_report optimized = optimizer::optimize_report();
 
-            create_and_add_tokenizer(tokenizer, base_increment_register, "regi");
-            create_and_add_tokenizer(tokenizer, base_decrement_register, "regd");
-            create_and_add_tokenizer(tokenizer, base_store_into_register, "load");
-            create_and_add_tokenizer(tokenizer, base_memory_to_register, "memr");
-            create_and_add_tokenizer(tokenizer, base_register_to_memory, "memw");
+    /// Formatted diagnostics, kept for the end of a batch
+    string diagnostics;
+};
 
-            create_and_add_tokenizer(tokenizer, base_write_state_register, "staw");
-            create_and_add_tokenizer(tokenizer, base_read_state_register, "star");
+/// Stream stdin into the target as it is read. A partial output file is removed again if assembling fails.
+bool assemble_stream (const string& target, assembly_tokenizer& tokenizer, tokenizer_result* result) {
+    bool to_stdout = (target == "-");
+    FILE* output = to_stdout ? stdout : fopen(target.c_str(), "wb");
+    if (output == nullptr) return false;
 
-            create_and_add_tokenizer(tokenizer, base_jump, "jump");
-            create_and_add_tokenizer(tokenizer, base_jump_compare, "jcmp");
-            create_and_add_tokenizer(tokenizer, base_compare, "cmpb");
-            create_and_add_tokenizer(tokenizer, base_compare_x16, "cmps");
+    stream_assembler stream = stream_assembler(&tokenizer);
+    bool ok = stream.assemble(stdin, output, result);
+    if (tokenizer.stats != nullptr) tokenizer.stats->bytes_written += (long long)stream.bytes_written;
 
-            create_and_add_tokenizer(tokenizer, alu_add, "add");
-            create_and_add_tokenizer(tokenizer, alu_sub, "sub");
-            create_and_add_tokenizer(tokenizer, alu_and, "and");
-            create_and_add_tokenizer(tokenizer, alu_or, "or");
-            create_and_add_tokenizer(tokenizer, alu_not, "not");
-            create_and_add_tokenizer(tokenizer, alu_xor, "xor");
+    if (!to_stdout) {
+        ok = (fclose(output) == 0) && ok;
+        if (!ok || result->errors > 0) remove(target.c_str());
+    }
+    return ok;
+}
+
+/// Write the source map of an assembled file next to its image
+void write_source_map (assembly_report& report, tokenizer_result& result, bool verbose) {
+    vector<byte> map = result.source_lines.encode(report.file == "-" ? "<stdin>" : report.file);
+    if (!emitter::write_image(report.target_file + ".map", map.data(), map.size())) {
+        if (verbose) cout << cout_err("Unable to write source map.") << endl;
+        report.status = 1;
+    }
+}
 
-            create_and_add_tokenizer(tokenizer, alu_shift_l, "shl");
-            create_and_add_tokenizer(tokenizer, alu_shift_r, "shr");
+/// Assemble a file into the target (<file>.bin if empty, stdout if "-"), using the given number of threads for the file itself.
+/// A file of "-" streams stdin into the target (stdout by default) with bounded memory.
+/// With caching enabled, unchanged blocks are taken from <target>.cache and an existing target is replaced. Timings and counters are added to stats if set.
+/// Diagnostics are printed right away in verbose mode and kept in the report otherwise.
+/// The report status is the process exit code for a single file: 0 on success,
+/// 1 if the output can't be written, 2 if the source can't be read, 3 on tokenizer errors and 4 if the target exists.
+assembly_report assemble_file (const string& file, const string& target, const assembler_options& options, unsigned int threads, assembly_stats* stats, bool verbose) {
+    assembly_report report = assembly_report();
+    report.file = file;
+    bool streamed = (file == "-");
+    report.target_file = !target.empty() ? target : (streamed ? "-" : file + (options.object ? ".o" : ".bin"));
 
-            create_and_add_tokenizer(tokenizer, ext_platform_info, "plat");
-            create_and_add_tokenizer(tokenizer, ext_invoke, "ext");
+    if (verbose) {
+        cout << "Source File: " << (streamed ? "<stdin>" : report.file) << endl;
+        cout << "Target File: " << (report.target_file == "-" ? "<stdout>" : report.target_file) << endl;
+    }
 
-            tokenizer.tokenize_file(stream, &result);
+    // The cache is for assembling the same file again, so it replaces the image of the last run
+    bool replace = options.cache && !streamed;
+    if (report.target_file != "-" && !replace && file_exists(report.target_file)) {
+        if (verbose) cout << cout_err("Target file already exists!") << endl;
+        report.status = 4;
+        return report;
+    }
 
-            cout << "\n";
+    if (verbose) cout << "\n";
 
-            /*for(bytecode_instruction instr : result.instructions) {
-                cout << full_length(short) << std::hex << instr.code << " ";
-                print_hex(&instr.data[0], instr.data.size());
-                cout << endl;
-            }
+    // Each thread keeps one arena for the jobs it runs, which grows to the largest of them and is then reused
+    static thread_local arena memory;
+    memory.reset();
 
-            cout << "\n";*/
+    tokenizer_result result = tokenizer_result(&memory);
+    if (!verbose) result.source_name = file;
+    size_t max_errors = (options.max_errors == 0) ? SIZE_MAX : options.max_errors;
+    result.diagnostic_limit = max_errors;
+    result.keep_relocations = options.optimize;
+    result.relocatable = options.object;
+    result.keep_source_map = options.source_map;
 
-            /*if (result.todos > 0) {
-                cout << "Found " << plural_num_string("to-do comment", result.todos) << "." << endl;
-            }*/
+    assembly_tokenizer tokenizer = assembly_tokenizer();
+    tokenizer.stats = stats;
+    if (!streamed) tokenizer.source_path = file;
 
-            if (result.errors > 0) {
-                int e = result.errors;
-                cout << "Compile failed: Tokenizer reported " << plural_num_string("errors", e) << "." << endl;
-                return 3;
-            } else {
-                auto size = (long long)result.instructions.size();
-                cout << "Successfully compiled " << plural_num_string("instruction", size) << "." << endl;
-            }
+    // A streamed image is written while it is assembled, so there's nothing left to write afterwards
+    bool written = false;
+    if (streamed) {
+        if (!assemble_stream(report.target_file, tokenizer, &result)) {
+            if (verbose) cout << cout_err("Unable to stream the output file.") << endl;
+            report.status = 1;
+            return report;
+        }
+        written = true;
+    } else {
+        source_file source = source_file();
+        {
+            phase_timer timer = phase_timer(stats, assembly_phase::read);
+            source.open_file(file);
+        }
 
-            ofstream output (target_file, ios::out | ios::binary);
-            if(!output) {
-                cout << cout_err("Unable to open output file.") << endl;
-                return 1;
+        if (!source.is_open()) {
+            if (verbose) cout << cout_err("Unable to open file.") << endl;
+            report.status = 2;
+            return report;
+        }
+
+        if (options.cache && report.target_file != "-") {
+            assembly_cache blocks = assembly_cache();
+            if (!blocks.tokenize(tokenizer, source, &result, report.target_file + ".cache") && verbose) {
+                cout << cout_err("Unable to write cache file.") << endl;
             }
 
-            for(bytecode_instruction instr : result.instructions) {
-                array<byte, 2> code_bytes = bin::short_to_bytes((short)instr.code);
-                output.write((char*)&code_bytes[0], 2);
-                output.write((char*)&instr.data[0], instr.data.size());
+            if (verbose) cout << "Reused " << blocks.blocks_reused << " of " << plural_num_string("cached block", (long long)blocks.blocks_total) << "." << endl;
+        } else {
+            tokenizer.tokenize_file(source, &result, threads);
+        }
+    }
+
+    if (options.optimize && !streamed && result.errors == 0) {
+        phase_timer timer = phase_timer(stats, assembly_phase::optimize);
+        optimizer::optimize_report removed = optimizer::optimize(result);
+        report.optimized = removed;
+        if (stats != nullptr) stats->optimized.add(removed);
+
+        if (verbose && removed.total() > 0) {
+            cout << "Optimizer removed " << plural_num_string("instruction", removed.total()) << ":" << endl;
+            for (size_t i = 0; i < optimizer::rules.size(); i++) {
+                if (removed.removed[i] > 0) cout << "  " << optimizer::rules[i].name << ": " << removed.removed[i] << endl;
             }
+        }
+    } else if (options.optimize && streamed && verbose) {
+        cout << cout_err("-O does not apply to streamed input.") << endl;
+    }
+
+    if (!result.diagnostics.empty() || result.errors > 0) {
+        phase_timer timer = phase_timer(stats, assembly_phase::report);
+        report.diagnostics = format_diagnostics(result.diagnostics, result.errors, max_errors, result.source_name);
+        if (verbose) cout << report.diagnostics << flush;
+    }
+
+    if (verbose) cout << "\n";
+
+    /*for(size_t i = 0; i < result.image.size(); i += INSTR_FULL_SIZE) {
+        print_hex(&result.image[i], INSTR_FULL_SIZE);
+        cout << endl;
+    }
+
+    cout << "\n";*/
+
+    /*if (result.todos > 0) {
+        cout << "Found " << plural_num_string("to-do comment", result.todos) << "." << endl;
+    }*/
 
-            output.flush();
-            output.close();
+    report.errors = result.errors;
+    report.instructions = (long long)result.instruction_count();
+
+    if (stats != nullptr) {
+        stats->files++;
+        stats->lines += result.lines;
+        stats->comments += result.comments;
+        stats->todos += result.todos;
+        stats->instructions += report.instructions;
+        stats->errors += result.errors;
+        stats->arena_peak = std::max(stats->arena_peak, (long long)memory.peak_usage());
+    }
+
+    if (result.errors > 0) {
+        if (verbose) cout << "Compile failed: Tokenizer reported " << plural_num_string("error", result.errors) << "." << endl;
+        report.status = 3;
+        return report;
+    } else if (verbose) {
+        cout << "Successfully compiled " << plural_num_string("instruction", report.instructions) << "." << endl;
+    }
+
+    if (written) {
+        if (options.source_map) write_source_map(report, result, verbose);
+        return report;
+    }
+
+    phase_timer timer = phase_timer(stats, assembly_phase::write);
+    bool ok = options.object ? object_file::write(report.target_file, result) : emitter::write_image(report.target_file, result.image.data(), result.image.size());
+    if (!ok) {
+        if (verbose) cout << cout_err("Unable to write output file.") << endl;
+        report.status = 1;
+        return report;
+    }
+
+    if (stats != nullptr) stats->bytes_written += (long long)result.image.size();
+
+    if (options.source_map) write_source_map(report, result, verbose);
+    return report;
+}
+
+/// Disassemble an image into the target (stdout if empty or "-").
+/// Returns the process exit code: 0 on success, 1 if the output can't be written, 2 if the image can't be read,
+/// 4 if the target exists and 5 if the image doesn't end on a whole record.
+int disassemble_file (const string& file, const string& target, unsigned int threads) {
+    bool to_stdout = (target.empty() || target == "-");
+    cout << "Image File: " << file << endl;
+    cout << "Target File: " << (to_stdout ? "<stdout>" : target) << "\n" << endl;
+
+    if (!to_stdout && file_exists(target)) {
+        cout << cout_err("Target file already exists!") << endl;
+        return 4;
+    }
+
+    source_file image = source_file(file);
+    if (!image.is_open()) {
+        cout << cout_err("Unable to open file.") << endl;
+        return 2;
+    }
+
+    FILE* output = to_stdout ? stdout : fopen(target.c_str(), "wb");
+    if (output == nullptr) {
+        cout << cout_err("Unable to write output file.") << endl;
+        return 1;
+    }
+
+    disassembler decoder = disassembler(threads);
+    bool ok = true;
+    string_view data = image.text();
+    decoder.disassemble((const byte*)data.data(), data.size(), [&](string_view text) {
+        if (ok && !text.empty()) ok = (fwrite(text.data(), 1, text.size(), output) == text.size());
+    });
+    ok = (fflush(output) == 0) && ok;
+    if (!to_stdout) ok = (fclose(output) == 0) && ok;
+
+    if (!ok) {
+        cout << cout_err("Unable to write output file.") << endl;
+        return 1;
+    }
+
+    cout << "Disassembled " << plural_num_string("record", (long long)decoder.records) << "." << endl;
+    if (decoder.data_records > 0) cout << "Wrote " << plural_num_string("record", (long long)decoder.data_records) << " that aren't instructions as data." << endl;
+    if (decoder.trailing_bytes > 0) {
+        cout << cout_err("The image ends with " << plural_num_string("byte", (long long)decoder.trailing_bytes) << " after the last record.") << endl;
+        return 5;
+    }
+    return 0;
+}
+
+/// Assemble a file, disassemble the image and assemble it again, checking that both images are the same.
+/// Returns the process exit code like assemble_file, with 5 if the images differ.
+int verify_file (const string& file, const assembler_options& options, unsigned int threads, assembly_stats* stats) {
+    cout << "Source File: " << file << "\n" << endl;
+
+    source_file source = source_file();
+    {
+        phase_timer timer = phase_timer(stats, assembly_phase::read);
+        source.open_file(file);
+    }
+
+    if (!source.is_open()) {
+        cout << cout_err("Unable to open file.") << endl;
+        return 2;
+    }
 
-            return 0;
+    tokenizer_result result = tokenizer_result();
+    result.diagnostic_limit = (options.max_errors == 0) ? SIZE_MAX : options.max_errors;
+
+    assembly_tokenizer tokenizer = assembly_tokenizer();
+    tokenizer.stats = stats;
+    tokenizer.source_path = file;
+    tokenizer.tokenize_file(source, &result, threads);
+
+    if (result.errors > 0) {
+        cout << format_diagnostics(result.diagnostics, result.errors, result.diagnostic_limit, result.source_name) << "\n";
+        cout << "Compile failed: Tokenizer reported " << plural_num_string("error", result.errors) << "." << endl;
+        return 3;
+    }
+
+    disassembler decoder = disassembler(threads);
+    size_t mismatch = decoder.verify(result.image.data(), result.image.size(), tokenizer);
+    if (mismatch != SIZE_MAX) {
+        cout << cout_err("Verification failed at record " << mismatch << " (offset 0x" << std::hex << mismatch * INSTR_FULL_SIZE << std::dec << ").") << endl;
+        return 5;
+    }
+
+    cout << "Verified " << plural_num_string("instruction", (long long)result.instruction_count()) << "." << endl;
+    return 0;
+}
+
+/// Read a response file listing one source file per line
+bool read_response_file (const string& file, vector<string>& files) {
+    source_file list = source_file(file);
+    if (!list.is_open()) return false;
+
+    string_view text = list.text();
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t end = text.find('\n', start);
+        if (end == string_view::npos) end = text.size();
+
+        string_view name = assembly_tokenizer::trim(text.substr(start, end - start));
+        if (!name.empty()) files.emplace_back(name);
+        start = end + 1;
+    }
+
+    return true;
+}
+
+/// Print the diagnostics and final status of every file in a batch, in command line order
+void print_batch_report (const vector<assembly_report>& reports) {
+    for (const assembly_report& report : reports) cout << report.diagnostics;
+    cout << "\n";
+
+    for (const assembly_report& report : reports) {
+        switch (report.status) {
+            case 0:
+                cout << "  OK      " << report.file << " -> " << report.target_file << " (" << plural_num_string("instruction", report.instructions);
+                if (report.optimized.total() > 0) cout << ", removed " << report.optimized.summary();
+                cout << ")";
+                break;
+            case 1: cout << "  FAILED  " << report.file << ": Unable to write output file."; break;
+            case 2: cout << "  FAILED  " << report.file << ": Unable to open file."; break;
+            case 3: cout << "  FAILED  " << report.file << ": " << plural_num_string("error", report.errors); break;
+            case 4: cout << "  SKIPPED " << report.file << ": Target file already exists!"; break;
+        }
+        cout << "\n";
+    }
+    cout << flush;
+}
+
+/// Print the statistics of a run in the requested format
+void print_stats (const assembly_stats& stats, int format) {
+#if KODA_ASM_STATS
+    if (format == 1) {
+        cout << "\n";
+        stats.print(cout);
+    } else if (format == 2) {
+        stats.print_json(cout);
+    }
+#else
+    if (format != 0) cout << cout_err("Statistics are not available in this build.") << endl;
+#endif
+}
+
+int main (int argc, char* argv[]) {
+    if (argc >= 2 && string(argv[1]) == "--instructions") {
+        instructions::print_reference(cout);
+        return 0;
+    }
+
+    vector<string> files; assembler_options options = assembler_options();
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-o" && i + 1 < argc) {
+            options.output = argv[++i];
+        } else if ((arg == "-j" || arg == "--jobs") && i + 1 < argc) {
+            // -j 0 uses every available core
+            options.jobs = (unsigned int)atoi(argv[++i]);
+            if (options.jobs == 0) options.jobs = std::max(1u, std::thread::hardware_concurrency());
+        } else if (arg == "--disassemble") {
+            options.mode = run_mode::disassemble;
+        } else if (arg == "--verify") {
+            options.mode = run_mode::verify;
+        } else if (arg == "-O") {
+            options.optimize = true;
+        } else if (arg == "-c") {
+            options.object = true;
+        } else if (arg == "--source-map") {
+            options.source_map = true;
+        } else if (arg == "--cache") {
+            options.cache = true;
+        } else if (arg == "--max-errors" && i + 1 < argc) {
+            options.max_errors = (size_t)atoll(argv[++i]);
+        } else if (arg == "--stats" || arg == "--stats=text") {
+            options.stats = 1;
+        } else if (arg == "--stats=json") {
+            options.stats = 2;
+        } else if (arg.size() > 1 && arg[0] == '@') {
+            if (!read_response_file(arg.substr(1), files)) {
+                cout << cout_err("Unable to open response file " << arg.substr(1) << ".") << endl;
+                return 2;
+            }
         } else {
-            cout << cout_err("Unable to open file.") << endl;
-            stream.close();
-            return 2;
+            files.push_back(arg);
         }
+    }
 
-        stream.close();
-    } else {
+    // When the image goes to stdout, everything else goes to stderr
+    bool streamed = (files.size() == 1 && files[0] == "-");
+    bool to_stdout = options.output.empty() && (streamed || options.mode == run_mode::disassemble);
+    if (options.output == "-" || to_stdout) cout.rdbuf(cerr.rdbuf());
+
+    cout << "Koda Assembler v1\n--------------------------\n" << endl;
+
+    if (files.empty()) {
         cout << cout_err("No file specified.") << endl;
         return 1;
     }
+
+    // The optimizer and streaming patch labels in place, which an object has to leave to the linker
+    if (options.object && (options.optimize || streamed)) {
+        cout << cout_err("-c can't be combined with " << (options.optimize ? "-O" : "streamed input") << ".") << endl;
+        return 1;
+    }
+
+    if (options.source_map && (options.object || options.output == "-" || to_stdout)) {
+        cout << cout_err("--source-map needs an image file" << (options.object ? ", not an object." : " to write the map next to.")) << endl;
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    assembly_stats stats = assembly_stats();
+
+    // Disassembly and verification decode on every core by default, since the output order doesn't depend on it
+    if (options.mode != run_mode::assemble) {
+        if (files.size() != 1) {
+            cout << cout_err((options.mode == run_mode::disassemble ? "--disassemble" : "--verify") << " takes a single file.") << endl;
+            return 1;
+        }
+
+        unsigned int threads = (options.jobs == 0) ? std::max(1u, std::thread::hardware_concurrency()) : options.jobs;
+        int status = (options.mode == run_mode::disassemble)
+            ? disassemble_file(files[0], options.output, threads)
+            : verify_file(files[0], options, threads, options.stats ? &stats : nullptr);
+
+        stats.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (options.mode == run_mode::verify) print_stats(stats, options.stats);
+        return status;
+    }
+
+    if (files.size() == 1) {
+        int status = assemble_file(files[0], options.output, options, std::max(1u, options.jobs), options.stats ? &stats : nullptr, true).status;
+
+        stats.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        print_stats(stats, options.stats);
+        return status;
+    }
+
+    if (!options.output.empty()) {
+        cout << cout_err("-o can only be used with a single file.") << endl;
+        return 1;
+    }
+
+    if (std::find(files.begin(), files.end(), "-") != files.end()) {
+        cout << cout_err("stdin can only be assembled on its own.") << endl;
+        return 1;
+    }
+
+    // Batch mode: every file is one task, each assembled on a single thread
+    unsigned int jobs = options.jobs;
+    if (jobs == 0) jobs = std::max(1u, std::thread::hardware_concurrency());
+    jobs = (unsigned int)std::min<size_t>(jobs, files.size());
+    cout << "Assembling " << plural_num_string("file", (long long)files.size()) << " on " << plural_num_string("thread", jobs) << ".\n" << endl;
+
+    vector<assembly_report> reports = vector<assembly_report>(files.size());
+    vector<assembly_stats> file_stats = vector<assembly_stats>(files.size());
+    {
+        thread_pool pool = thread_pool(jobs);
+        for (size_t i = 0; i < files.size(); i++) {
+            pool.submit([&reports, &file_stats, &files, &options, i] {
+                reports[i] = assemble_file(files[i], "", options, 1, options.stats ? &file_stats[i] : nullptr, false);
+            });
+        }
+        pool.wait();
+    }
+
+    print_batch_report(reports);
+
+    // Phase times of a batch are summed over all files
+    for (const assembly_stats& entry : file_stats) stats.add(entry);
+    stats.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    print_stats(stats, options.stats);
+
+    for (const assembly_report& report : reports) {
+        if (report.status != 0) return report.status;
+    }
+    return 0;
 }
@@ -0,0 +1,53 @@
+#include "shared.hpp"
+#include "assembler/source_file.hpp"
+#include "assembler/source_map.hpp"
+#include "assembler/bytecode.hpp"
+#include "utils.hpp"
+
+/// Print the source line of program counters, using the source map written by koda_asm --source-map.
+/// Addresses are byte offsets into the image, as the VM reports them; with --index they are record indices instead.
+/// Returns 0 if every address was found, 1 on bad arguments, 2 if the map can't be read and 3 if an address isn't in the map.
+int main (int argc, char* argv[]) {
+    if (argc < 3) {
+        cout << "Usage: koda_map <image>.map <address>... [--index]" << endl;
+        return 1;
+    }
+
+    bool index = false;
+    vector<string> addresses;
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--index") index = true;
+        else addresses.push_back(arg);
+    }
+
+    source_file file = source_file();
+    source_map_reader map = source_map_reader();
+    if (!file.open_file(argv[1]) || !map.open(file.text())) {
+        cout << cout_err("Unable to read source map " << argv[1] << ".") << endl;
+        return 2;
+    }
+
+    int status = 0;
+    for (const string& address : addresses) {
+        // Decimal unless marked as hex, so a leading zero isn't read as octal
+        bool hex = address.size() > 2 && address[0] == '0' && (address[1] == 'x' || address[1] == 'X');
+        const char* digits = address.c_str() + (hex ? 2 : 0);
+        char* end = nullptr;
+        uint64_t value = strtoull(digits, &end, hex ? 16 : 10);
+        if (end == digits || *end != '\0' || !isxdigit((unsigned char)*digits)) {
+            cout << cout_err("Invalid address '" << address << "'.") << endl;
+            return 1;
+        }
+
+        uint64_t record = index ? value : value / INSTR_FULL_SIZE;
+        uint32_t line = map.line_of(record);
+        if (line == 0) {
+            cout << address << ": not in the image (" << plural_num_string("record", (long long)map.records) << ")" << endl;
+            status = 3;
+            continue;
+        }
+        cout << address << ": " << map.source_name << ":" << line << endl;
+    }
+    return status;
+}
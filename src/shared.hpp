@@ -3,7 +3,22 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <string_view>
 #include <array>
+#include <vector>
+#include <cstdint>
+#include <climits>
+#include <charconv>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <deque>
+#include <filesystem>
+#include <memory_resource>
+#include <optional>
 using namespace std;
 
 #define byte unsigned char
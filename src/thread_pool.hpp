@@ -0,0 +1,134 @@
+#pragma once
+#include "shared.hpp"
+
+/// A fixed-size pool of worker threads with one task queue per worker.
+/// Workers take tasks from the back of their own queue and steal from the front of the others when it runs dry.
+class thread_pool {
+    protected:
+        struct task_queue {
+            std::mutex lock;
+            std::deque<std::function<void()>> tasks;
+        };
+
+        vector<unique_ptr<task_queue>> queues;
+        vector<std::thread> workers;
+
+        std::mutex state_lock;
+        std::condition_variable wake;
+        std::condition_variable idle;
+        size_t queued = 0;
+        size_t unfinished = 0;
+        size_t next_queue = 0;
+        bool stopping = false;
+
+        /// The queue index of the calling thread if it is one of our workers
+        static size_t& current_worker () {
+            static thread_local size_t index = SIZE_MAX;
+            return index;
+        }
+
+        bool try_pop (size_t self, std::function<void()>& task) {
+            {
+                task_queue& own = *queues[self];
+                std::lock_guard<std::mutex> guard (own.lock);
+                if (!own.tasks.empty()) {
+                    task = std::move(own.tasks.back());
+                    own.tasks.pop_back();
+                    return true;
+                }
+            }
+
+            for (size_t i = 1; i < queues.size(); i++) {
+                task_queue& victim = *queues[(self + i) % queues.size()];
+                std::lock_guard<std::mutex> guard (victim.lock);
+                if (!victim.tasks.empty()) {
+                    task = std::move(victim.tasks.front());
+                    victim.tasks.pop_front();
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        void work (size_t self) {
+            current_worker() = self;
+
+            while (true) {
+                std::function<void()> task;
+                if (try_pop(self, task)) {
+                    {
+                        std::lock_guard<std::mutex> guard (state_lock);
+                        queued--;
+                    }
+
+                    task();
+
+                    std::lock_guard<std::mutex> guard (state_lock);
+                    if (--unfinished == 0) idle.notify_all();
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> guard (state_lock);
+                wake.wait(guard, [this] { return stopping || queued > 0; });
+                if (stopping && queued == 0) return;
+            }
+        }
+
+    public:
+        explicit thread_pool (unsigned int threads) {
+            threads = std::max(1u, threads);
+            for (unsigned int i = 0; i < threads; i++) queues.push_back(std::make_unique<task_queue>());
+            for (unsigned int i = 0; i < threads; i++) workers.emplace_back(&thread_pool::work, this, i);
+        }
+
+        thread_pool (const thread_pool&) = delete;
+        thread_pool& operator= (const thread_pool&) = delete;
+
+        ~thread_pool () {
+            {
+                std::lock_guard<std::mutex> guard (state_lock);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (std::thread& worker : workers) worker.join();
+        }
+
+        size_t size () const {
+            return workers.size();
+        }
+
+        /// Queue a task. Tasks submitted from a worker go to that worker's own queue.
+        void submit (std::function<void()> task) {
+            std::lock_guard<std::mutex> guard (state_lock);
+
+            size_t target = current_worker();
+            if (target >= queues.size()) target = (next_queue++) % queues.size();
+
+            {
+                std::lock_guard<std::mutex> queue_guard (queues[target]->lock);
+                queues[target]->tasks.push_back(std::move(task));
+            }
+
+            queued++;
+            unfinished++;
+            wake.notify_one();
+        }
+
+        /// Block until every submitted task has finished
+        void wait () {
+            std::unique_lock<std::mutex> guard (state_lock);
+            idle.wait(guard, [this] { return unfinished == 0; });
+        }
+};
+
+/// Run the task once for each chunk index, one thread per chunk, with chunk 0 on the calling thread.
+/// For short fan-outs over data that is already split, where a pool's queues would only add overhead.
+template <typename F>
+void run_chunks (size_t count, F task) {
+    vector<std::thread> workers;
+    for (size_t i = 1; i < count; i++) workers.emplace_back(task, i);
+
+    if (count > 0) task(0);
+    for (std::thread& worker : workers) worker.join();
+}